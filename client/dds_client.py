@@ -1,6 +1,7 @@
 #!/usr/bin/env python
 
 import argparse
+import json
 import os
 import socket
 import struct
@@ -8,16 +9,63 @@ import sys
 
 DDS_DATA_FORMATS = ['8bit', '12bit_LEFT', '12bit_RIGHT']
 DDS_MODES = ['independent', 'single_trigger', 'dual']
+DDS_FRAME_TYPES = ['waveform', 'stream', 'nco', 'synth', 'sequence', 'sweep', 'retune', 'cached']
+DDS_SYNTH_SHAPES = ['sine', 'square', 'triangle', 'saw']
+DDS_FRAME_TYPE_SHIFT = 4
+DDS_FLAG_SESSION = 0x08
+DDS_FLAG_RATE = 0x80
+DDS_RESULTS = ['OK', 'invalid header', 'invalid checksum', 'invalid data',
+               'invalid configuration', 'no enough memory', 'timeout', 'not cached',
+               'flash error', 'SD card error']
+DDS_DETAILS = ['', 'magic', 'version', 'size', 'extension size', 'unknown extension',
+               'extension length', 'rate', 'frame type']
+
+STREAM_CHUNK_SIZE = 4096
+
+# TIM6 input clock, see SetSysClock() in system_stm32f4xx.c: 8 MHz HSE,
+# PLL M=8 N=288 P=2 gives 144 MHz SYSCLK, APB1 runs at SYSCLK/4 and its
+# timers at twice that
+DDS_SYSCLK = 8000000 // 8 * 288 // 2
+DDS_TIMER_CLOCK = 2 * (DDS_SYSCLK // 4)
 
 DDS_HEADER_STR = '<4cIIB'
 DDS_CHCONFIG_STR = '<BBIIIH'
+DDS_REPLY_STR = '<4sBIIIii'
+
+DDS_PROTOCOL_VERSION = 2
+DDS_HEADER_V2_STR = '<4sBBBBIIHH'
+DDS_CHCONFIG_V2_STR = '<BBHIII'
+DDS_TLV_STR = '<HH'
+DDS_TLV_RATE = 1
+DDS_TLV_CRITICAL = 0x8000
+DDS_REPLY_V2_STR = '<4sBBHIIIii'
+DDS_SEQ_ENTRY_STR = '<IIHHIH'
+DDS_SEQ_END = 0xFFFF
+DDS_LIB_OPS = ['store', 'play', 'delete', 'list', 'save', 'clear',
+               'sd_save', 'sd_play', 'sd_delete', 'sd_count', 'sd_format',
+               'sd_record', 'sd_stream', 'underruns']
+DDS_SWEEP_CONFIG_STR = '<IIII'
 
-def create_header(mode, size):
+def crc32_stm32(data):
+    """CRC of STM32 CRC unit: poly 0x04C11DB7, init 0xFFFFFFFF, little
+    endian 32-bit words fed MSB first, last word padded with zeros."""
+    data = bytes(data) + b'\0' * (-len(data) % 4)
+    crc = 0xFFFFFFFF
+    for (word,) in struct.iter_unpack('<I', data):
+        crc ^= word
+        for _ in range(32):
+            if crc & 0x80000000:
+                crc = ((crc << 1) ^ 0x04C11DB7) & 0xFFFFFFFF
+            else:
+                crc = (crc << 1) & 0xFFFFFFFF
+    return crc
+
+def create_header(mode, size, frame_type=0, checksum=0):
     return struct.pack(DDS_HEADER_STR,
                        b'M', b'A', b'R', b'M', 
-                       0, 
+                       checksum, 
                        size,
-                       mode)
+                       mode | (frame_type << DDS_FRAME_TYPE_SHIFT))
     
 def create_chconfig(enabled, format=0, offset=0, size=0, period=0, prescaler=0):
     return struct.pack(DDS_CHCONFIG_STR,
@@ -28,37 +76,408 @@ def create_chconfig(enabled, format=0, offset=0, size=0, period=0, prescaler=0):
                        period,
                        prescaler)
 
+def sample_width(mode, format):
+    """Bytes per DMA transfer, chconfig data_size counts these."""
+    if mode & 0x07 == DDS_MODES.index('dual'):
+        return 2 if format == 0 else 4
+    return 1 if format == 0 else 2
+
+def create_sequence(entries, header_size, period, prescaler):
+    """Sequence payload from list of dicts with file, repeat (0 - forever),
+    next (entry index, None stops, default is following entry), period
+    and prescaler. Returns (payload, samples)."""
+    table_size = 2 + len(entries) * struct.calcsize(DDS_SEQ_ENTRY_STR)
+    table = [struct.pack('<H', len(entries))]
+    samples = b''
+
+    for i, entry in enumerate(entries):
+        # keep every waveform word aligned in device memory
+        samples += b'\0' * (-(header_size + table_size + len(samples)) % 4)
+        with open(entry['file'], 'rb') as f:
+            data = f.read()
+
+        default_next = i + 1 if i + 1 < len(entries) else None
+        next_entry = entry.get('next', default_next)
+
+        table.append(struct.pack(DDS_SEQ_ENTRY_STR,
+                                 table_size + len(samples),
+                                 len(data) // entry.get('width', 1),
+                                 entry.get('repeat', 1),
+                                 DDS_SEQ_END if next_entry is None else next_entry,
+                                 entry.get('period', period),
+                                 entry.get('prescaler', prescaler)))
+        samples += data
+
+    return b''.join(table) + samples
+
+def create_chirp(start, stop, steps, prescaler):
+    """Timer periods sweeping sample rate linearly from start to stop Hz,
+    always 32-bit, device with 16-bit timers rejects periods above 0xFFFF."""
+    periods = []
+    for i in range(steps):
+        rate = start + (stop - start) * i / max(steps - 1, 1)
+        period = int(round(DDS_TIMER_CLOCK / ((prescaler + 1) * rate))) - 1
+        periods.append(min(max(period, 1), 0xFFFFFFFF))
+    return struct.pack('<%dI' % steps, *periods)
+
+def to_v2(frame):
+    """Rewrite v1 frame header as v2 header, sample rates go to extension."""
+    header_size = struct.calcsize(DDS_HEADER_STR) + 2 * struct.calcsize(DDS_CHCONFIG_STR)
+    fields = struct.unpack(DDS_HEADER_STR, frame[:struct.calcsize(DDS_HEADER_STR)])
+    checksum, size, mode = fields[4:]
+    chconfigs = [struct.unpack_from(DDS_CHCONFIG_STR, frame,
+                                    struct.calcsize(DDS_HEADER_STR) + i * struct.calcsize(DDS_CHCONFIG_STR))
+                 for i in range(2)]
+
+    ext = b''
+    if mode & DDS_FLAG_RATE:
+        rates = [ch[4] if ch[0] else 0 for ch in chconfigs]
+        ext = struct.pack(DDS_TLV_STR, DDS_TLV_RATE | DDS_TLV_CRITICAL, 8) + struct.pack('<II', *rates)
+
+    v2_size = struct.calcsize(DDS_HEADER_V2_STR) + 2 * struct.calcsize(DDS_CHCONFIG_V2_STR) + len(ext)
+    header = struct.pack(DDS_HEADER_V2_STR, b'MAR2', DDS_PROTOCOL_VERSION,
+                         (mode >> DDS_FRAME_TYPE_SHIFT) & 0x07, mode & 0x07, mode & DDS_FLAG_SESSION,
+                         size - header_size + v2_size if size else 0, checksum, len(ext), 0)
+    for enabled, format, offset, data_size, period, prescaler in chconfigs:
+        header += struct.pack(DDS_CHCONFIG_V2_STR, enabled, format, prescaler,
+                              offset, data_size, period)
+    return header + ext + frame[header_size:]
+
+def format_rates(rates, errors):
+    """Achieved sample rates of DDS_FLAG_RATE frame, empty if not requested."""
+    return ''.join(', ch%d %.3f Hz (%+.3f ppm)' % (i + 1, rate / 1000.0, error / 1000.0)
+                   for i, (rate, error) in enumerate(zip(rates, errors)) if rate)
+
+def recv_exact(sock, size, data=b''):
+    while len(data) < size:
+        chunk = sock.recv(size - len(data))
+        if not chunk:
+            raise IOError('connection closed by device')
+        data += chunk
+    return data
+
+def read_reply(sock):
+    """Read one binary reply (v1 session or v2), returns (result string, value, rates)."""
+    data = recv_exact(sock, 4)
+    if data == b'MARR':
+        data = recv_exact(sock, struct.calcsize(DDS_REPLY_STR), data)
+        magic, res, value, rate1, rate2, error1, error2 = struct.unpack(DDS_REPLY_STR, data)
+        detail = 0
+    elif data == b'MRR2':
+        data = recv_exact(sock, struct.calcsize(DDS_REPLY_V2_STR), data)
+        (magic, version, res, detail, value,
+         rate1, rate2, error1, error2) = struct.unpack(DDS_REPLY_V2_STR, data)
+    else:
+        raise IOError('invalid reply')
+    result = DDS_RESULTS[res] if res < len(DDS_RESULTS) else str(res)
+    if detail:
+        result += ' (%s)' % (DDS_DETAILS[detail] if detail < len(DDS_DETAILS) else detail)
+    return result, value, format_rates((rate1, rate2), (error1, error2))
+
+def recv_reply(sock, v2):
+    """Reply to single frame, text from v1 devices."""
+    if not v2:
+        return sock.recv(128)
+    return '%s %s%s' % read_reply(sock)
+
 if __name__ == '__main__':
     parser = argparse.ArgumentParser(description='MARM_DDS client.')
     parser.add_argument('address', help='IP address of MARM_DDS device')
-    parser.add_argument('file',  type=argparse.FileType('rb'), help='file with samples')
+    parser.add_argument('file',  type=argparse.FileType('rb'), nargs='?',
+                        help='file with samples (not used with --nco)')
     parser.add_argument('--mode', choices=DDS_MODES,
                         default=DDS_MODES[1], help='DDS mode')
     parser.add_argument('--format', choices=DDS_DATA_FORMATS, 
                         default=DDS_DATA_FORMATS[0], help='samples format')
     parser.add_argument('--period', type=int, default=1, help='DAC period')
     parser.add_argument('--prescaler', type=int, default=1, help='DAC prescaler')
+    parser.add_argument('--rate', type=float, metavar='HZ',
+                        help='sample rate in Hz, device picks period and prescaler and '
+                             'replies with achieved rate (overrides --period/--prescaler)')
+    parser.add_argument('--stream', action='store_true',
+                        help='stream samples while playing instead of uploading them first '
+                             '(use - as file to stream from stdin)')
+    parser.add_argument('--nco', type=float, metavar='FREQ',
+                        help='generate sine of FREQ Hz on device, sample clock is set by '
+                             '--period and --prescaler; a running NCO with the same sample '
+                             'clock is retuned without phase jump')
     
+    parser.add_argument('--v2', action='store_true',
+                        help='send frames with v2 protocol header, device replies in binary')
+    parser.add_argument('--session', action='store_true',
+                        help='keep connection open and pipeline all waveform files, '
+                             'device replies to each of them')
+    parser.add_argument('--next', type=argparse.FileType('rb'), action='append', default=[],
+                        metavar='FILE', help='further waveform file sent in the same session')
+    parser.add_argument('--sequence', type=argparse.FileType('r'), metavar='JSON',
+                        help='play sequence of waveforms, JSON list of entries with file, repeat '
+                             '(0 - forever), next (entry index or null to stop), period, prescaler '
+                             'and width (bytes per transfer)')
+    parser.add_argument('--cache', action='store_true',
+                        help='ask device to play waveform cached under its checksum first, '
+                             'upload it only if it is not there')
+    parser.add_argument('--store', type=int, metavar='ID',
+                        help='keep waveform file in device library under ID instead of playing it')
+    parser.add_argument('--play', type=int, metavar='ID',
+                        help='play waveform ID from device library, at --rate if given')
+    parser.add_argument('--delete', type=int, metavar='ID', help='drop waveform ID from device library')
+    parser.add_argument('--list', action='store_true', help='list waveform IDs in device library')
+    parser.add_argument('--save', action='store_true',
+                        help='save playing waveform to device flash, it starts at power on')
+    parser.add_argument('--clear', action='store_true', help='erase waveform saved in device flash')
+    parser.add_argument('--sd-save', type=int, metavar='ID',
+                        help='save playing waveform to device SD card under ID (0-255)')
+    parser.add_argument('--sd-play', type=int, metavar='ID', help='load waveform ID from device SD card and play it')
+    parser.add_argument('--sd-delete', type=int, metavar='ID', help='drop waveform ID from device SD card')
+    parser.add_argument('--sd-count', action='store_true', help='count waveforms on device SD card')
+    parser.add_argument('--sd-format', action='store_true',
+                        help='start empty waveform store on device SD card, card contents are lost')
+    parser.add_argument('--sd-record', type=int, metavar='ID',
+                        help='stream file to device SD card under ID instead of playing it')
+    parser.add_argument('--sd-stream', type=int, metavar='ID',
+                        help='play stream recorded on device SD card under ID')
+    parser.add_argument('--underruns', action='store_true',
+                        help='show underruns of the stream played last on device')
+    parser.add_argument('--retune', action='store_true',
+                        help='only change sample rate of running output to --period/--prescaler')
+    parser.add_argument('--chirp', type=float, nargs=2, metavar=('START', 'STOP'),
+                        help='sweep sample rate from START to STOP Hz, one step per sample')
+    parser.add_argument('--synth', choices=DDS_SYNTH_SHAPES,
+                        help='generate one period of SYNTH shape on device instead of uploading samples')
+    parser.add_argument('--length', type=int, default=256, help='synth samples per period')
+    parser.add_argument('--amplitude', type=int, default=2047, help='synth peak amplitude, 12-bit DAC units')
+    parser.add_argument('--offset', type=int, default=2048, help='synth DC level, 12-bit DAC units')
+    parser.add_argument('--phase', type=float, default=0, help='synth start phase in degrees')
+
     args = parser.parse_args()
+    if (args.nco is None and args.synth is None and args.sequence is None and
+            args.play is None and args.delete is None and not args.list and
+            not args.save and not args.clear and args.sd_save is None and
+            args.sd_play is None and args.sd_delete is None and
+            not args.sd_count and not args.sd_format and
+            args.sd_stream is None and not args.underruns and
+            not args.retune and args.file is None):
+        parser.error('file is required')
+    if args.rate is not None and (args.sequence is not None or args.chirp is not None):
+        parser.error('--rate does not apply to sequence entries and chirp tables')
     
     sock = socket.socket(socket.AF_INET, socket.SOCK_STREAM)
 
     server_address = (args.address, 1234)
     sock.connect(server_address)
     
-    file1_size = os.fstat(args.file.fileno()).st_size
-    frame_size = file1_size + struct.calcsize(DDS_HEADER_STR) + struct.calcsize(DDS_CHCONFIG_STR) 
-    
-    frame = []   
-    frame.append(create_header(1, frame_size))
-    frame.append(create_chconfig(1, DDS_DATA_FORMATS.index(args.format), 0, file1_size, args.period, args.prescaler))
-    frame.append(create_chconfig(0))
-    frame.append(args.file.read())
-    
-    try:  
-        sock.sendall(b''.join(frame))
-        data = sock.recv(128)
-        print(data)
+    mode = DDS_MODES.index(args.mode)
+    if args.session:
+        mode |= DDS_FLAG_SESSION
+    if args.rate is not None:
+        # period carries the rate in mHz, device replaces it with timer settings
+        mode |= DDS_FLAG_RATE
+        args.period = int(round(args.rate * 1000))
+        args.prescaler = 0
+    format = DDS_DATA_FORMATS.index(args.format)
+    header_size = struct.calcsize(DDS_HEADER_STR) + 2 * struct.calcsize(DDS_CHCONFIG_STR)
+    # v2 payload starts word aligned on device, v1 right after header
+    data_align = 0 if args.v2 else header_size
+    width = sample_width(mode, format)
+
+    def pad_samples(samples):
+        """Payload with samples word aligned on device, returns (payload, offset)."""
+        offset = -data_align % 4
+        return b'\0' * offset + samples, offset
+
+    def send(frame):
+        sock.sendall(to_v2(frame) if args.v2 else frame)
+
+    def library(op, id=0, timing=0):
+        # library commands are sent in session to get reply value
+        cmd = struct.pack('<BB', DDS_LIB_OPS.index(op), id)
+        send(create_header(mode | DDS_FLAG_SESSION, header_size + len(cmd), DDS_FRAME_TYPES.index('cached'),
+                           crc32_stm32(cmd)) +
+             create_chconfig(timing, format, 0, 0, args.period, args.prescaler) +
+             create_chconfig(0) +
+             cmd)
+        return read_reply(sock)
+
+    try:
+        if args.list:
+            result, value, rates = library('list')
+            print('%s: %s' % (result, ' '.join(str(i) for i in range(32) if value & (1 << i))))
+        elif args.play is not None:
+            print('%s %s%s' % library('play', args.play, 1 if args.rate is not None else 0))
+        elif args.save or args.clear:
+            print('%s %s%s' % library('save' if args.save else 'clear'))
+        elif args.delete is not None:
+            print('%s %s%s' % library('delete', args.delete))
+        elif args.sd_save is not None:
+            print('%s %s%s' % library('sd_save', args.sd_save))
+        elif args.sd_play is not None:
+            print('%s %s%s' % library('sd_play', args.sd_play))
+        elif args.sd_delete is not None:
+            print('%s %s%s' % library('sd_delete', args.sd_delete))
+        elif args.sd_count:
+            result, value, rates = library('sd_count')
+            print('%s: %d' % (result, value))
+        elif args.sd_format:
+            print('%s %s%s' % library('sd_format'))
+        elif args.sd_stream is not None:
+            print('%s %s%s' % library('sd_stream', args.sd_stream))
+        elif args.underruns:
+            result, value, rates = library('underruns')
+            print('%s: %d' % (result, value))
+        elif args.store is not None:
+            result = library('store', args.store)
+            if result[0] != 'OK':
+                print('%s %s%s' % result)
+                sys.exit(1)
+
+            samples = args.file.read()
+            payload, data_offset = pad_samples(samples)
+            send(create_header(mode | DDS_FLAG_SESSION, header_size + len(payload),
+                               checksum=crc32_stm32(payload)) +
+                 create_chconfig(1, format, data_offset, len(samples) // width,
+                                 args.period, args.prescaler) +
+                 create_chconfig(0) +
+                 payload)
+            print('%s %s%s' % read_reply(sock))
+        elif args.retune:
+            send(create_header(mode, header_size, DDS_FRAME_TYPES.index('retune')) +
+                         create_chconfig(1, format, 0, 0, args.period, args.prescaler) +
+                         create_chconfig(0))
+            print(recv_reply(sock, args.v2))
+        elif args.nco is not None:
+            if args.rate is not None:
+                sample_rate = args.rate
+            else:
+                sample_rate = DDS_TIMER_CLOCK / ((args.period + 1) * (args.prescaler + 1))
+            tuning_word = int(round(args.nco / sample_rate * 2**32)) & 0xFFFFFFFF
+            nco_config = struct.pack('<I', tuning_word)
+
+            send(create_header(mode, header_size + len(nco_config),
+                                       DDS_FRAME_TYPES.index('nco'),
+                                       crc32_stm32(nco_config)) +
+                         create_chconfig(1, format, 0, 0, args.period, args.prescaler) +
+                         create_chconfig(0) +
+                         nco_config)
+            print(recv_reply(sock, args.v2))
+        elif args.chirp is not None:
+            samples = args.file.read()
+            sweep_size = struct.calcsize(DDS_SWEEP_CONFIG_STR)
+            # waveform after sweep config, period table after samples, both aligned
+            data_offset = sweep_size + (-(data_align + sweep_size) % 4)
+            table_offset = data_offset + len(samples) + (-(data_align + data_offset + len(samples)) % 4)
+            table = create_chirp(args.chirp[0], args.chirp[1], len(samples) // width, args.prescaler)
+
+            payload = struct.pack(DDS_SWEEP_CONFIG_STR, table_offset, len(table) // 4, 0, 0)
+            payload += b'\0' * (data_offset - len(payload)) + samples
+            payload += b'\0' * (table_offset - len(payload)) + table
+
+            send(create_header(mode, header_size + len(payload),
+                                       DDS_FRAME_TYPES.index('sweep'),
+                                       crc32_stm32(payload)) +
+                         create_chconfig(1, format, data_offset, len(samples) // width,
+                                         args.period, args.prescaler) +
+                         create_chconfig(0) +
+                         payload)
+            print(recv_reply(sock, args.v2))
+        elif args.sequence is not None:
+            payload = create_sequence(json.load(args.sequence), data_align,
+                                      args.period, args.prescaler)
+
+            send(create_header(mode, header_size + len(payload),
+                                       DDS_FRAME_TYPES.index('sequence'),
+                                       crc32_stm32(payload)) +
+                         create_chconfig(1, format, 0, 0, args.period, args.prescaler) +
+                         create_chconfig(0) +
+                         payload)
+            print(recv_reply(sock, args.v2))
+        elif args.synth is not None:
+            phase = int(round(args.phase % 360 / 360 * 2**32)) & 0xFFFFFFFF
+            synth_config = struct.pack('<BHHII', DDS_SYNTH_SHAPES.index(args.synth),
+                                       args.amplitude, args.offset, phase, args.length)
+
+            send(create_header(mode, header_size + len(synth_config),
+                                       DDS_FRAME_TYPES.index('synth'),
+                                       crc32_stm32(synth_config)) +
+                         create_chconfig(1, format, 0, 0, args.period, args.prescaler) +
+                         create_chconfig(0) +
+                         synth_config)
+            print(recv_reply(sock, args.v2))
+        elif args.stream or args.sd_record is not None:
+            if args.sd_record is not None:
+                result = library('sd_record', args.sd_record)
+                if result[0] != 'OK':
+                    print('%s %s%s' % result)
+                    sys.exit(1)
+                # connection is in session now, reply comes binary
+                mode |= DDS_FLAG_SESSION
+
+            # unknown size (pipe) streams until connection is closed
+            try:
+                file1_size = os.fstat(args.file.fileno()).st_size
+            except (OSError, ValueError):
+                file1_size = 0
+            frame_size = header_size + file1_size if file1_size else 0
+
+            send(create_header(mode, frame_size, DDS_FRAME_TYPES.index('stream')) +
+                         create_chconfig(1, format, 0, 0, args.period, args.prescaler) +
+                         create_chconfig(0))
+
+            chunk = args.file.read(STREAM_CHUNK_SIZE)
+            while chunk:
+                # blocks while device ring is full
+                sock.sendall(chunk)
+                chunk = args.file.read(STREAM_CHUNK_SIZE)
+
+            if frame_size and args.sd_record is not None:
+                print('%s %s%s' % read_reply(sock))
+            elif frame_size:
+                print(recv_reply(sock, args.v2))
+        elif args.session:
+            files = [args.file] + args.next
+
+            # frames are pipelined, replies are read after all are sent
+            for f in files:
+                samples = f.read()
+                payload, data_offset = pad_samples(samples)
+                send(create_header(mode, header_size + len(payload),
+                                           checksum=crc32_stm32(payload)) +
+                             create_chconfig(1, format, data_offset, len(samples) // width,
+                                             args.period, args.prescaler) +
+                             create_chconfig(0) +
+                             payload)
+
+            for f in files:
+                print('%s: %s %s%s' % ((f.name,) + read_reply(sock)))
+        else:
+            samples = args.file.read()
+            payload, data_offset = pad_samples(samples)
+            frame_size = header_size + len(payload)
+            checksum = crc32_stm32(payload)
+
+            if args.cache:
+                # session keeps connection open for upload after miss
+                mode |= DDS_FLAG_SESSION
+                send(create_header(mode, header_size, DDS_FRAME_TYPES.index('cached'), checksum) +
+                     create_chconfig(1, format, data_offset, len(samples) // width,
+                                     args.period, args.prescaler) +
+                     create_chconfig(0))
+                reply = read_reply(sock)
+                if reply[0] != 'not cached':
+                    print('cached: %s %s%s' % reply)
+                    sys.exit(0)
+
+            frame = []
+            frame.append(create_header(mode, frame_size, checksum=checksum))
+            frame.append(create_chconfig(1, format, data_offset, len(samples) // width,
+                                         args.period, args.prescaler))
+            frame.append(create_chconfig(0))
+            frame.append(payload)
+
+            send(b''.join(frame))
+            if args.cache:
+                print('uploaded: %s %s%s' % read_reply(sock))
+            else:
+                print(recv_reply(sock, args.v2))
 
     finally:
-        sock.close()
\ No newline at end of file
+        sock.close()
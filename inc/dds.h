@@ -8,6 +8,7 @@
 #define INC_DDS_H_
 
 #include <stdbool.h>
+#include <stdint.h>
 
 #ifndef likely
  #define likely(x) (x)
@@ -17,6 +18,26 @@
  #define unlikely(x) (x)
 #endif
 
+/* size of one DMA double buffer block in streaming mode */
+#ifndef DDS_STREAM_BLOCK_SIZE
+ #define DDS_STREAM_BLOCK_SIZE 1024
+#endif
+
+/* shortest DMA segment of waveforms longer than 65535 transfers */
+#ifndef DDS_SEGMENT_MIN_SIZE
+ #define DDS_SEGMENT_MIN_SIZE 256
+#endif
+
+/* NCO sine table size is 2^DDS_NCO_LUT_BITS entries */
+#ifndef DDS_NCO_LUT_BITS
+ #define DDS_NCO_LUT_BITS 12
+#endif
+
+/* samples generated per half of NCO ping-pong buffer */
+#ifndef DDS_NCO_BLOCK_SIZE
+ #define DDS_NCO_BLOCK_SIZE 256
+#endif
+
 /*#ifndef __packed
  #define __packed __attribute__((packed))
 #endif*/
@@ -33,9 +54,40 @@ enum dds_mode {
 	DDS_MODE_DUAL,
 };
 
+/* frame type, kept in bits 6:4 of dds_header.mode */
+enum dds_frame_type {
+	DDS_FRAME_WAVEFORM,				/* samples follow header, played from memory */
+	DDS_FRAME_STREAM,				/* samples keep flowing after header 		 */
+	DDS_FRAME_NCO,					/* dds_nco_config follows header 			 */
+	DDS_FRAME_SYNTH,				/* dds_synth_config follows header 			 */
+	DDS_FRAME_SEQUENCE,				/* dds_seq_config, entries, samples 		 */
+	DDS_FRAME_SWEEP,				/* dds_sweep_config, samples, rate tables 	 */
+	DDS_FRAME_RETUNE,				/* header only, new period/prescaler 		 */
+	DDS_FRAME_CACHED,				/* checksum of cached waveform or library cmd */
+};
+
+enum dds_synth_shape {
+	DDS_SHAPE_SINE,
+	DDS_SHAPE_SQUARE,
+	DDS_SHAPE_TRIANGLE,
+	DDS_SHAPE_SAW,
+};
+
+#define DDS_MODE_MASK				0x07
+#define DDS_FRAME_TYPE_SHIFT		4
+#define DDS_FRAME_TYPE_MASK			0x07
+
+/* mode flags, around frame type */
+#define DDS_FLAG_SESSION			0x08	/* keep connection open, reply with dds_reply */
+#define DDS_FLAG_RATE				0x80	/* ch[].period is sample rate in mHz */
+
+#define DDS_MODE(mode)				((mode) & DDS_MODE_MASK)
+#define DDS_FRAME_TYPE(mode)		(((mode) >> DDS_FRAME_TYPE_SHIFT) & DDS_FRAME_TYPE_MASK)
+
 typedef struct dds_struct {
 	void (*dds_sync)(void);
 	void (*dds_err)(void);
+	void (*dds_drain)(void);		/* stream block played, ring has room 	*/
 } dds;
 
 typedef __packed struct dds_channel_config {
@@ -66,6 +118,78 @@ typedef __packed struct dds_header_struct {
 	void  			*data[0];		/* samples	 							*/
 } dds_header;
 
+/* NCO frame payload, output frequency = tuning_word * fs / 2^32 */
+typedef __packed struct dds_nco_config {
+	uint32_t		tuning_word;	/* phase increment per sample 			*/
+} dds_nco_config;
+
+/* synth frame payload, one period is generated on device */
+typedef __packed struct dds_synth_config {
+	uint8_t			shape;			/* enum dds_synth_shape 				*/
+	uint16_t		amplitude;		/* peak amplitude, 12-bit DAC units 	*/
+	uint16_t		offset;			/* DC level, 12-bit DAC units 			*/
+	uint32_t		phase;			/* start phase, 2^32 is full period 	*/
+	uint32_t		length;			/* samples per period 					*/
+} dds_synth_config;
+
+/* sequence frame payload, followed by entry table and samples */
+typedef __packed struct dds_seq_config {
+	uint16_t		nentries;		/* number of entries 					*/
+} dds_seq_config;
+
+#define DDS_SEQ_END					0xffff
+
+typedef __packed struct dds_seq_entry {
+	uint32_t		data_offset;	/* offset from dds_header.data 			*/
+	uint32_t		data_size;		/* waveform length in transfers 		*/
+	uint16_t		repeat;			/* times played, 0 - forever 			*/
+	uint16_t		next;			/* entry played next, DDS_SEQ_END stops */
+
+	uint32_t		period;			/* timer period */
+	uint16_t		prescaler;		/* timer prescaler */
+} dds_seq_entry;
+
+/* library command, payload of DDS_FRAME_CACHED */
+typedef __packed struct dds_library_cmd {
+	uint8_t			cmd;			/* enum dds_library_op 					*/
+	uint8_t			id;				/* waveform ID, RAM ones below DDS_LIB_IDS */
+} dds_library_cmd;
+
+enum dds_library_op {
+	DDS_LIB_STORE,					/* keep next waveform frame under ID 	*/
+	DDS_LIB_PLAY,					/* play waveform with ID 				*/
+	DDS_LIB_DELETE,					/* drop waveform with ID 				*/
+	DDS_LIB_LIST,					/* dds_reply.value is bitmap of IDs 	*/
+	DDS_LIB_SAVE,					/* keep playing waveform in flash for boot */
+	DDS_LIB_CLEAR,					/* boot silent 							*/
+	DDS_LIB_SD_SAVE,				/* keep playing waveform on SD card under ID */
+	DDS_LIB_SD_PLAY,				/* load waveform with ID from SD card, play it */
+	DDS_LIB_SD_DELETE,				/* drop waveform with ID from SD card 	*/
+	DDS_LIB_SD_COUNT,				/* dds_reply.value is waveforms on card 	*/
+	DDS_LIB_SD_FORMAT,				/* empty log, drops all card waveforms 	*/
+	DDS_LIB_SD_RECORD,				/* write next stream frame to SD card under ID */
+	DDS_LIB_SD_STREAM,				/* play stream recorded on SD card 		*/
+	DDS_LIB_UNDERRUNS,				/* dds_reply.value is underruns of last stream */
+};
+
+#define DDS_LIB_IDS					32
+
+/* sample clock ARR in memory, TIM6/TIM7 are 16-bit, TIM2/TIM5 32-bit */
+#ifdef DDS_TIMER_32BIT
+typedef uint32_t dds_period_t;
+#else
+typedef uint16_t dds_period_t;
+#endif
+
+/* sweep frame payload, waveform frame with per-sample timer period tables,
+ * periods are uint32_t on the wire and narrowed to dds_period_t in place */
+typedef __packed struct dds_sweep_config {
+	struct {
+		uint32_t	table_offset;	/* uint32_t values, from dds_header.data */
+		uint32_t	table_size;		/* number of values, 0 - fixed rate 	*/
+	} ch[2];						/* channel 1 and 2 (independent mode) 	*/
+} dds_sweep_config;
+
 typedef enum dds_res {
 	DDS_OK = 0,
 	DDS_ERR_HEADER,
@@ -74,16 +198,137 @@ typedef enum dds_res {
 	DDS_ERR_CONFIG,
 	DDS_ERR_MEM,
 	DDS_ERR_TIMEOUT,
+	DDS_ERR_NOT_CACHED,
+	DDS_ERR_FLASH,
+	DDS_ERR_SD,
 } dds_res;
 
+/* reply to every frame sent with DDS_FLAG_SESSION */
+typedef __packed struct dds_reply_struct {
+	char			magic[4];		/* "MARR" 								*/
+	uint8_t			res;			/* enum dds_res 						*/
+	uint32_t		value;			/* DDS_ERR_MEM: bytes available 		*/
+	uint32_t		rate[2];		/* DDS_FLAG_RATE: achieved rate in mHz	*/
+	int32_t			error[2];		/* achieved rate error in ppb 			*/
+} dds_reply;
+
+/*
+ * Protocol v2, all fields naturally aligned. Header is followed by
+ * ext_size bytes of dds_tlv extensions, then by payload laid out as
+ * dds_header.data of v1 frames. Payload lands word aligned in memory.
+ */
+#define DDS_PROTOCOL_VERSION		2
+
+typedef struct dds_chconfig_v2_struct {
+	uint8_t			enabled;		/* channel enabled 						*/
+	uint8_t			data_format;	/* samples data format 					*/
+	uint16_t		prescaler;		/* timer prescaler 						*/
+	uint32_t		data_offset;	/* offset from payload 					*/
+	uint32_t		data_size;		/* size of data 						*/
+	uint32_t		period;			/* timer period 						*/
+} dds_chconfig_v2;
+
+typedef struct dds_header_v2_struct {
+	char			magic[4];		/* "MAR2" 								*/
+	uint8_t			version;		/* DDS_PROTOCOL_VERSION 				*/
+	uint8_t			type;			/* enum dds_frame_type 					*/
+	uint8_t			mode;			/* enum dds_mode 						*/
+	uint8_t			flags;			/* DDS_FLAG_SESSION 					*/
+	uint32_t		size;			/* whole frame, 0 - unbounded stream 	*/
+	uint32_t		checksum;		/* payload checksum 					*/
+	uint16_t		ext_size;		/* bytes of extensions, multiple of 4 	*/
+	uint16_t		reserved;
+	dds_chconfig_v2	ch[2];			/* DAC channel 1 and 2 					*/
+} dds_header_v2;
+
+/* extension block, value is padded to multiple of 4 bytes */
+typedef struct dds_tlv_struct {
+	uint16_t		type;			/* enum dds_tlv_type, DDS_TLV_CRITICAL 	*/
+	uint16_t		length;			/* value bytes 							*/
+} dds_tlv;
+
+enum dds_tlv_type {
+	DDS_TLV_RATE = 1,				/* uint32_t[2] sample rate in mHz 		*/
+};
+
+/* frame must be rejected if extension is not known */
+#define DDS_TLV_CRITICAL			0x8000
+
+/* largest extension area accepted */
+#ifndef DDS_EXT_MAX_SIZE
+ #define DDS_EXT_MAX_SIZE 64
+#endif
+
+/* what exactly was wrong, reported in v2 replies */
+enum dds_detail {
+	DDS_DETAIL_NONE = 0,
+	DDS_DETAIL_MAGIC,				/* unknown frame magic 					*/
+	DDS_DETAIL_VERSION,				/* unsupported protocol version 		*/
+	DDS_DETAIL_SIZE,				/* frame size below header size 		*/
+	DDS_DETAIL_EXT_SIZE,			/* extensions too long or unaligned 	*/
+	DDS_DETAIL_EXT_UNKNOWN,			/* unknown critical extension 			*/
+	DDS_DETAIL_EXT_LENGTH,			/* extension value of wrong length 		*/
+	DDS_DETAIL_RATE,				/* sample rate can not be reached 		*/
+	DDS_DETAIL_FRAME_TYPE,			/* unknown frame type 					*/
+};
+
+/* reply to every v2 frame */
+typedef struct dds_reply_v2_struct {
+	char			magic[4];		/* "MRR2" 								*/
+	uint8_t			version;		/* DDS_PROTOCOL_VERSION 				*/
+	uint8_t			res;			/* enum dds_res 						*/
+	uint16_t		detail;			/* enum dds_detail 						*/
+	uint32_t		value;			/* DDS_ERR_MEM: bytes available 		*/
+	uint32_t		rate[2];		/* DDS_TLV_RATE: achieved rate in mHz 	*/
+	int32_t			error[2];		/* achieved rate error in ppb 			*/
+} dds_reply_v2;
+
 const char *dds_res_to_str(enum dds_res res);
 
 bool dds_verify_header(dds_header *header);
 
+bool dds_verify_header_v2(const dds_header_v2 *header);
+
+bool dds_verify_checksum(dds_header *header, uint32_t crc);
+
 int DDS_Start(dds_header *header);
 
+int DDS_Swap(dds_header *header);
+
+void DDS_CompleteSwap(void);
+
 void DDS_Stop(void);
 
+struct dds_ring;
+
+int DDS_StartStream(dds_header *header, struct dds_ring *ring);
+
+uint32_t DDS_StreamUnderruns(void);
+
+bool DDS_StreamActive(void);
+
+uint32_t DDS_StreamByteRate(const dds_header *header);
+
+int DDS_StartNco(dds_header *header, const dds_nco_config *nco);
+
+void DDS_SetTuningWord(uint32_t tuning_word);
+
+bool DDS_NcoActive(void);
+
+int DDS_StartSequence(dds_header *header);
+
+int DDS_StartSweep(dds_header *header);
+
+int DDS_Retune(dds_header *header);
+
+int DDS_Synthesize(const dds_synth_config *synth, enum dds_data_format format, void *buf);
+
+uint32_t DDS_TimerClock(void);
+
+uint64_t DDS_SolveRate(uint64_t rate_mhz, uint32_t *period, uint16_t *prescaler);
+
+int DDS_SolveRates(dds_header *header, uint32_t rate[2]);
+
 void DDS_Init(dds dds_struct);
 
 #endif /* INC_DDS_H_ */
@@ -0,0 +1,23 @@
+/*
+ * dds_arena.h
+ *
+ *      Waveform sample storage placed by the linker script in all SRAM
+ *      left after data, bss and heap (.dds_arena section).
+ */
+
+#ifndef INC_DDS_ARENA_H_
+#define INC_DDS_ARENA_H_
+
+#include <stddef.h>
+
+void dds_arena_init(void);
+
+size_t dds_arena_capacity(void);
+
+size_t dds_arena_available(void);
+
+void *dds_arena_alloc(size_t size);
+
+void dds_arena_reset(void);
+
+#endif /* INC_DDS_ARENA_H_ */
@@ -0,0 +1,23 @@
+/*
+ * dds_crc.h
+ *
+ *      Frame checksum computed by the CRC unit (CRC-32, poly 0x04C11DB7,
+ *      init 0xFFFFFFFF, fed with little endian 32-bit words, last word
+ *      zero padded) while frame data is being received.
+ */
+
+#ifndef INC_DDS_CRC_H_
+#define INC_DDS_CRC_H_
+
+#include <stddef.h>
+#include <stdint.h>
+
+void dds_crc_init(void);
+
+void dds_crc_reset(void);
+
+void dds_crc_update(const void *data, size_t len);
+
+uint32_t dds_crc_final(void);
+
+#endif /* INC_DDS_CRC_H_ */
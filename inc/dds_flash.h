@@ -0,0 +1,23 @@
+/*
+ * dds_flash.h
+ *
+ *      Boot waveform kept in the last flash sector (sector 11, 128K),
+ *      which is left out of FLASH region in LinkerScript.ld.
+ */
+
+#ifndef INC_DDS_FLASH_H_
+#define INC_DDS_FLASH_H_
+
+#include <stddef.h>
+#include <stdint.h>
+#include <stdbool.h>
+
+size_t dds_flash_capacity(void);
+
+bool dds_flash_save(const void *data, size_t size, uint32_t offset);
+
+const void *dds_flash_load(size_t *size, uint32_t *offset);
+
+bool dds_flash_erase(void);
+
+#endif /* INC_DDS_FLASH_H_ */
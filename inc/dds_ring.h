@@ -0,0 +1,42 @@
+/*
+ * dds_ring.h
+ *
+ *      Single producer / single consumer byte ring used to feed
+ *      samples to the DAC DMA while it is running.
+ */
+
+#ifndef INC_DDS_RING_H_
+#define INC_DDS_RING_H_
+
+#include <stddef.h>
+#include <stdint.h>
+#include <stdbool.h>
+
+struct dds_ring {
+	uint8_t			*buf;			/* ring storage 						*/
+	size_t			size;			/* ring size, power of two 				*/
+
+	volatile size_t	head;			/* bytes written by producer 			*/
+	volatile size_t	tail;			/* bytes read by consumer 				*/
+	volatile bool	eof;			/* producer will not write any more 	*/
+};
+
+void dds_ring_init(struct dds_ring *ring, void *buf, size_t size);
+
+size_t dds_ring_used(const struct dds_ring *ring);
+
+size_t dds_ring_space(const struct dds_ring *ring);
+
+size_t dds_ring_write(struct dds_ring *ring, const void *data, size_t len);
+
+size_t dds_ring_read(struct dds_ring *ring, void *data, size_t len);
+
+size_t dds_ring_write_span(struct dds_ring *ring, void **data);
+
+void dds_ring_produce(struct dds_ring *ring, size_t len);
+
+size_t dds_ring_read_span(struct dds_ring *ring, const void **data);
+
+void dds_ring_consume(struct dds_ring *ring, size_t len);
+
+#endif /* INC_DDS_RING_H_ */
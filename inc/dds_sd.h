@@ -0,0 +1,49 @@
+/*
+ * dds_sd.h
+ *
+ *      Waveform store on SD card without a file system, waveforms are
+ *      looked up by ID in a log kept on the card and moved between card
+ *      and RAM by SDIO DMA in whole blocks. Streams too large for RAM
+ *      are recorded and played back block by block.
+ */
+
+#ifndef INC_DDS_SD_H_
+#define INC_DDS_SD_H_
+
+#include <stddef.h>
+#include <stdint.h>
+#include <stdbool.h>
+
+#include "dds.h"
+
+#define DDS_SD_BLOCK		512
+#define DDS_SD_IDS			256
+
+/* bytes moved for size bytes of data, buffers must be this large and 16-byte aligned */
+#define DDS_SD_SPAN(size)	(((size) + DDS_SD_BLOCK - 1) & ~(DDS_SD_BLOCK - 1))
+
+bool dds_sd_init(void);
+
+dds_res dds_sd_format(void);
+
+dds_res dds_sd_save(uint8_t id, const void *data, size_t size, uint32_t offset);
+
+dds_res dds_sd_load(uint8_t id, void *data, size_t max_size, size_t *size, uint32_t *offset);
+
+dds_res dds_sd_delete(uint8_t id);
+
+unsigned dds_sd_count(void);
+
+dds_res dds_sd_record_begin(uint8_t id, const void *header, size_t size);
+
+dds_res dds_sd_record_write(const void *data, uint32_t count);
+
+dds_res dds_sd_record_end(size_t size);
+
+void dds_sd_record_abort(void);
+
+dds_res dds_sd_stream_open(uint8_t id, void *header, size_t *size);
+
+dds_res dds_sd_stream_read(void *data, uint32_t count);
+
+#endif /* INC_DDS_SD_H_ */
@@ -30,6 +30,10 @@
 #ifndef __DDS_SERVER_H__
 #define __DDS_SERVER_H__
 
+void dds_server_restore(void);
+
 void dds_server_init(void);
 
+void dds_server_process(void);
+
 #endif /* __DDS_SERVER_H__ */
@@ -100,6 +100,8 @@
 /* Exported functions ------------------------------------------------------- */  
 void Time_Update(void);
 void Delay(uint32_t nCount);
+void Deferred_Request(void);
+void Deferred_Handle(void);
 
 
 #ifdef __cplusplus
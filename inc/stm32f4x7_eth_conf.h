@@ -80,6 +80,13 @@
  #define ETH_TXBUFNB        5                   /* 5  Tx buffers of size ETH_TX_BUF_SIZE */
 #endif
 
+/* Spare Rx buffers swapped into Rx descriptors while received frames are on
+   loan to lwIP (zero-copy receive in ethernetif.c) */
+#define ETH_RX_SPARE_BUFNB  4
+
+/* Most received frames handed to lwIP per ethernetif_input() call */
+#define ETH_RX_BATCH        8
+
 
 /* PHY configuration section **************************************************/
 /* PHY Reset delay */ 
@@ -6,20 +6,474 @@
 
 #include <stddef.h>
 #include <stdbool.h>
+#include <string.h>
 
 #include "stm32f4xx_dac.h"
 #include "stm32f4xx_dma.h"
 #include "stm32f4xx_gpio.h"
+#include "stm32f4xx_rcc.h"
+#include "stm32f4xx_tim.h"
 
 #include "dds.h"
+#include "dds_ring.h"
 
 static struct dds_struct state;
 
+/* sample clock timer and the DMA request used to stream its ARR */
+struct dds_timer_struct {
+	TIM_TypeDef			*tim;
+	uint32_t			rcc;			/* APB1 clock enable bit 				*/
+	uint32_t			dac_trigger;	/* DAC trigger on TRGO 					*/
+	uint32_t			max_period;		/* largest ARR value 					*/
+	DMA_Stream_TypeDef	*up_dma;		/* DMA1 stream of update request 		*/
+	uint32_t			up_dma_channel;
+	IRQn_Type			irq;			/* update interrupt 					*/
+};
+
+#ifdef DDS_TIMER_32BIT
+/* TIM2_UP: DMA1 Stream1 channel 3, TIM5_UP: DMA1 Stream0 channel 6 */
+static const struct dds_timer_struct dds_timer[2] = {
+	{ TIM2, RCC_APB1Periph_TIM2, DAC_Trigger_T2_TRGO, 0xffffffff, DMA1_Stream1, DMA_Channel_3, TIM2_IRQn },
+	{ TIM5, RCC_APB1Periph_TIM5, DAC_Trigger_T5_TRGO, 0xffffffff, DMA1_Stream0, DMA_Channel_6, TIM5_IRQn },
+};
+#else
+/* TIM6_UP: DMA1 Stream1 channel 7, TIM7_UP: DMA1 Stream2 channel 1 */
+static const struct dds_timer_struct dds_timer[2] = {
+	{ TIM6, RCC_APB1Periph_TIM6, DAC_Trigger_T6_TRGO, 0xffff, DMA1_Stream1, DMA_Channel_7, TIM6_DAC_IRQn },
+	{ TIM7, RCC_APB1Periph_TIM7, DAC_Trigger_T7_TRGO, 0xffff, DMA1_Stream2, DMA_Channel_1, TIM7_IRQn },
+};
+#endif
+
+/* first timer paces channel 1 and every shared mode, second one channel 2 */
+#define DDS_TIMER1	(&dds_timer[0])
+#define DDS_TIMER2	(&dds_timer[1])
+
+/* streaming playback state */
+static struct dds_stream_struct {
+	struct dds_ring		*ring;			/* producer ring, NULL if not streaming	*/
+	uint32_t			width;			/* bytes per DMA transfer 				*/
+	volatile uint32_t	underruns;		/* blocks not filled completely 		*/
+	uint8_t				drain;			/* TCs left once ring ran dry at eof 	*/
+} stream;
+
+/* DMA double buffer blocks used in streaming mode */
+static uint8_t stream_buf[2][DDS_STREAM_BLOCK_SIZE] __attribute__((aligned(4)));
+
+#define DDS_NCO_LUT_SIZE	(1 << DDS_NCO_LUT_BITS)
+
+/* phase accumulator state */
+static struct dds_nco_struct {
+	bool				active;			/* ping-pong buffer filled from LUT 	*/
+	uint32_t			phase;			/* phase accumulator 					*/
+	volatile uint32_t	tuning_word;	/* phase increment per sample 			*/
+	uint32_t			period;			/* sample clock of running NCO 			*/
+	uint16_t			prescaler;
+} nco;
+
+/* sine table is only read by CPU, keep it off the DMA bus in CCM */
+static uint16_t nco_lut[DDS_NCO_LUT_SIZE] __attribute__((section(".ccmbss")));
+
+/* circular DMA buffer, HT and TC interrupts refill the half just played */
+static uint16_t nco_buf[2 * DDS_NCO_BLOCK_SIZE];
+
+static void dds_nco_fill(uint16_t *block)
+{
+	uint32_t phase = nco.phase;
+	uint32_t tuning_word = nco.tuning_word;
+	int i;
+
+	for (i = 0; i < DDS_NCO_BLOCK_SIZE; i++) {
+		block[i] = nco_lut[phase >> (32 - DDS_NCO_LUT_BITS)];
+		phase += tuning_word;
+	}
+
+	nco.phase = phase;
+}
+
+/* sin(x) for x in [0, pi/2], libm is not linked */
+static double dds_sin_quarter(double x)
+{
+	double x2 = x * x;
+
+	return x * (1 - x2 / 6 * (1 - x2 / 20 * (1 - x2 / 42 * (1 - x2 / 72 * (1 - x2 / 110)))));
+}
+
+static void dds_nco_lut_init(void)
+{
+	const double pi = 3.14159265358979323846;
+	int quarter = DDS_NCO_LUT_SIZE / 4;
+	int i;
+
+	for (i = 0; i <= quarter; i++) {
+		/* 12-bit right aligned, full scale */
+		uint16_t a = (uint16_t) (2047.0 * dds_sin_quarter(pi / 2 * i / quarter) + 0.5);
+
+		nco_lut[i] = 2048 + a;
+		nco_lut[2 * quarter - i] = 2048 + a;
+		nco_lut[(2 * quarter + i) % DDS_NCO_LUT_SIZE] = 2048 - a;
+		nco_lut[(4 * quarter - i) % DDS_NCO_LUT_SIZE] = 2048 - a;
+	}
+}
+
+static void dds_stream_fill(uint8_t *block)
+{
+	size_t len = dds_ring_read(stream.ring, block, DDS_STREAM_BLOCK_SIZE);
+
+	if (likely(len == DDS_STREAM_BLOCK_SIZE))
+		return;
+
+	/* short last block of finished stream is not an underrun */
+	if (!stream.ring->eof || dds_ring_used(stream.ring))
+		stream.underruns++;
+
+	/* hold the last complete sample until producer catches up */
+	len -= len % stream.width;
+	if (len == 0) {
+		uint8_t *other = (block == stream_buf[0]) ? stream_buf[1] : stream_buf[0];
+		memcpy(block, other + DDS_STREAM_BLOCK_SIZE - stream.width, stream.width);
+		len = stream.width;
+	}
+	for (; len < DDS_STREAM_BLOCK_SIZE; len += stream.width)
+		memcpy(block + len, block + len - stream.width, stream.width);
+}
+
+static void dds_stream_refill(void)
+{
+	/* last filled block has been played */
+	if (unlikely(stream.drain) && --stream.drain == 0) {
+		DDS_Stop();
+		return;
+	}
+
+	/* DMA switched to the other memory target, refill the one just played */
+	if (DMA_GetCurrentMemoryTarget(DMA1_Stream5) == 0)
+		dds_stream_fill(stream_buf[1]);
+	else
+		dds_stream_fill(stream_buf[0]);
+
+	/* block playing now and the one just filled still have to go out */
+	if (unlikely(stream.ring->eof && dds_ring_used(stream.ring) == 0)) {
+		if (!stream.drain)
+			stream.drain = 2;
+	} else if (likely(state.dds_drain)) {
+		state.dds_drain();
+	}
+}
+
+/* waveform started by DDS_Start, DDS_Swap can replace it without restart */
+static struct dds_play_struct {
+	bool				active;
+	uint8_t				mode;
+	dds_chconfig		ch[2];
+} play;
+
+enum dds_swap_state {
+	DDS_SWAP_IDLE,
+	DDS_SWAP_PENDING,					/* waiting for end of current period 	*/
+	DDS_SWAP_ARMED,						/* idle memory target holds new waveform */
+};
+
+/* waveform split in equal segments, each fits 16-bit NDTR */
+struct dds_wave_struct {
+	uint32_t			addr;			/* first segment 						*/
+	uint32_t			seg_size;		/* segment size in bytes 				*/
+	uint16_t			count;			/* segment length in transfers 			*/
+	uint16_t			nseg;			/* number of segments 					*/
+};
+
+/* waveform played by one DMA stream, walked segment by segment in TC interrupt */
+static struct dds_walk_struct {
+	DMA_Stream_TypeDef	*dma;
+	uint32_t			dma_flags;		/* all stream flags, cleared on restart */
+	uint32_t			tc_flag;
+	uint32_t			dac_channel;
+
+	struct dds_wave_struct cur;			/* playing waveform 					*/
+	uint16_t			next;			/* segment in idle memory target 		*/
+
+	/* switch to new waveform at period boundary */
+	volatile uint8_t	state;
+	struct dds_wave_struct new;
+
+	TIM_TypeDef			*tim;			/* timer to retune, NULL if shared 		*/
+	uint32_t			period;
+	uint16_t			prescaler;
+	volatile bool		retime;			/* retune at next update event 			*/
+} walk[2] = {
+	{
+		.dma 		 = DMA1_Stream5,
+		.dma_flags 	 = DMA_FLAG_TCIF5 | DMA_FLAG_HTIF5 | DMA_FLAG_TEIF5 |
+					   DMA_FLAG_DMEIF5 | DMA_FLAG_FEIF5,
+		.tc_flag	 = DMA_FLAG_TCIF5,
+		.dac_channel = DAC_Channel_1,
+	},
+	{
+		.dma 		 = DMA1_Stream6,
+		.dma_flags 	 = DMA_FLAG_TCIF6 | DMA_FLAG_HTIF6 | DMA_FLAG_TEIF6 |
+					   DMA_FLAG_DMEIF6 | DMA_FLAG_FEIF6,
+		.tc_flag	 = DMA_FLAG_TCIF6,
+		.dac_channel = DAC_Channel_2,
+	},
+};
+
+/* fewest equal segments of at most 65535 transfers, 0 if there are none */
+static uint16_t dds_wave_segments(uint32_t size)
+{
+	uint32_t nseg = (size + 0xfffe) / 0xffff;
+	uint32_t max_nseg = size / DDS_SEGMENT_MIN_SIZE;
+
+	if (size == 0)
+		return 0;
+
+	if (nseg == 1)
+		return 1;
+
+	/* interrupt must reload idle target before DMA gets to it */
+	if (max_nseg > 0xffff)
+		max_nseg = 0xffff;
+
+	while (nseg <= max_nseg && size % nseg)
+		nseg++;
+
+	if (nseg > max_nseg)
+		return 0;
+
+	return nseg;
+}
+
+static void dds_wave_split(struct dds_wave_struct *wave, void *addr, uint32_t size, uint32_t width)
+{
+	wave->addr 	   = (uint32_t) addr;
+	wave->nseg 	   = dds_wave_segments(size);
+	wave->count    = size / wave->nseg;
+	wave->seg_size = wave->count * width;
+}
+
+static uint32_t dds_wave_segment(struct dds_wave_struct *wave, uint16_t seg)
+{
+	return wave->addr + seg * wave->seg_size;
+}
+
+/* ARR is preloaded, both take effect at next update event */
+static void dds_tim_retune(TIM_TypeDef *TIMx, uint32_t period, uint16_t prescaler)
+{
+	TIM_SetAutoreload(TIMx, period);
+	TIM_PrescalerConfig(TIMx, prescaler, TIM_PSCReloadMode_Update);
+}
+
+static void dds_walk_retime(struct dds_walk_struct *w)
+{
+	if (w->tim)
+		dds_tim_retune(w->tim, w->period, w->prescaler);
+}
+
+/*
+ * Last sample of old waveform is in DHR and goes out at next update event,
+ * new rate is written from that update's interrupt so it starts with the
+ * first sample of new waveform.
+ */
+static void dds_walk_retime_next(struct dds_walk_struct *w)
+{
+	if (!w->tim)
+		return;
+
+	w->retime = true;
+	TIM_ClearITPendingBit(w->tim, TIM_IT_Update);
+	TIM_ITConfig(w->tim, TIM_IT_Update, ENABLE);
+}
+
+/* retune queued by dds_walk_retime_next() still waiting for its update event */
+static void dds_walk_retime_pending(struct dds_walk_struct *w)
+{
+	if (!w->retime)
+		return;
+
+	w->retime = false;
+	TIM_ITConfig(w->tim, TIM_IT_Update, DISABLE);
+	dds_walk_retime(w);
+}
+
+static void dds_walk_update(TIM_TypeDef *TIMx)
+{
+	int i;
+
+	if (TIM_GetITStatus(TIMx, TIM_IT_Update) != SET)
+		return;
+
+	TIM_ClearITPendingBit(TIMx, TIM_IT_Update);
+	TIM_ITConfig(TIMx, TIM_IT_Update, DISABLE);
+
+	for (i = 0; i < 2; i++) {
+		if (walk[i].retime && walk[i].tim == TIMx) {
+			walk[i].retime = false;
+			dds_walk_retime(&walk[i]);
+		}
+	}
+}
+
+/* play current waveform from its start, NDTR can only be changed with stream disabled */
+static void dds_walk_restart(struct dds_walk_struct *w)
+{
+	DMA_Cmd(w->dma, DISABLE);
+	while (DMA_GetCmdStatus(w->dma) == ENABLE)
+		;
+
+	w->next = 1 % w->cur.nseg;
+
+	DMA_ClearFlag(w->dma, w->dma_flags);
+	DMA_SetCurrDataCounter(w->dma, w->cur.count);
+	DMA_MemoryTargetConfig(w->dma, dds_wave_segment(&w->cur, 0), DMA_Memory_0);
+	DMA_MemoryTargetConfig(w->dma, dds_wave_segment(&w->cur, w->next), DMA_Memory_1);
+	w->dma->CR &= ~DMA_SxCR_CT;
+
+	/* single segment wraps by itself */
+	DMA_DoubleBufferModeCmd(w->dma, w->cur.nseg > 1 ? ENABLE : DISABLE);
+	DMA_ITConfig(w->dma, DMA_IT_TC, w->cur.nseg > 1 ? ENABLE : DISABLE);
+	DMA_Cmd(w->dma, ENABLE);
+
+	/* DAC stops requesting DMA after underrun */
+	if (DAC_GetFlagStatus(w->dac_channel, DAC_FLAG_DMAUDR) == SET) {
+		DAC_ClearFlag(w->dac_channel, DAC_FLAG_DMAUDR);
+		DAC_DMACmd(w->dac_channel, DISABLE);
+		DAC_DMACmd(w->dac_channel, ENABLE);
+	}
+}
+
+/* called on transfer complete, DMA has just moved to the other memory target */
+static void dds_walk_step(struct dds_walk_struct *w)
+{
+	uint32_t idle = DMA_GetCurrentMemoryTarget(w->dma) ? DMA_Memory_0 : DMA_Memory_1;
+
+	switch (w->state) {
+	case DDS_SWAP_PENDING:
+		/* transfer count is shared by both targets, restart as old waveform wraps,
+		   single segment has no idle target at all */
+		if (w->new.count != w->cur.count || w->cur.nseg == 1) {
+			if (w->next != 0)
+				break;
+
+			w->cur = w->new;
+			dds_walk_retime(w);
+			dds_walk_restart(w);
+			w->state = DDS_SWAP_IDLE;
+			return;
+		}
+
+		/* segment now playing is the last one, queue new waveform after it */
+		if ((w->next + 1) % w->cur.nseg != 0)
+			break;
+
+		w->cur = w->new;
+		w->next = 0;
+		DMA_MemoryTargetConfig(w->dma, dds_wave_segment(&w->cur, 0), idle);
+		w->state = DDS_SWAP_ARMED;
+		return;
+	case DDS_SWAP_ARMED:
+		/* DMA has moved to first segment of new waveform */
+		dds_walk_retime_next(w);
+		w->state = DDS_SWAP_IDLE;
+		break;
+	}
+
+	w->next = (w->next + 1) % w->cur.nseg;
+	DMA_MemoryTargetConfig(w->dma, dds_wave_segment(&w->cur, w->next), idle);
+
+	/* both targets hold the only segment of new waveform, nothing left to walk */
+	if (w->cur.nseg == 1 && w->state == DDS_SWAP_IDLE)
+		DMA_ITConfig(w->dma, DMA_IT_TC, DISABLE);
+}
+
+/* timer period tables written to ARR by DMA on every update event */
+static bool sweep_active;
+
+/* sequence walked block by block, all entries are multiple of one block */
+static struct dds_seq_struct {
+	bool				active;
+	const dds_seq_entry	*entries;
+	uint8_t				*data;			/* dds_header.data 						*/
+	uint16_t			count;			/* block length in transfers 			*/
+	uint32_t			block_size;		/* block size in bytes 					*/
+
+	/* position of block in idle memory target */
+	uint16_t			entry;
+	uint32_t			block;
+	uint16_t			pass;
+
+	bool				retime;			/* block starts entry with its own rate */
+	bool				end;			/* nothing follows the loaded block 	*/
+} seq;
+
+static uint32_t dds_seq_block_addr(void)
+{
+	return (uint32_t) (seq.data + seq.entries[seq.entry].data_offset + seq.block * seq.block_size);
+}
+
+/* move to the next block, false at end of sequence */
+static bool dds_seq_advance(void)
+{
+	const dds_seq_entry *e = &seq.entries[seq.entry];
+
+	if (++seq.block < e->data_size / seq.count)
+		return true;
+	seq.block = 0;
+
+	if (e->repeat == 0 || ++seq.pass < e->repeat)
+		return true;
+	seq.pass = 0;
+
+	if (e->next == DDS_SEQ_END)
+		return false;
+	seq.entry = e->next;
+
+	return true;
+}
+
+static void dds_seq_step(void)
+{
+	uint32_t idle = DMA_GetCurrentMemoryTarget(DMA1_Stream5) ? DMA_Memory_0 : DMA_Memory_1;
+	uint16_t entry = seq.entry;
+
+	/* last block has been played */
+	if (seq.end) {
+		DDS_Stop();
+		return;
+	}
+
+	/* block now playing is the first of an entry */
+	if (seq.retime) {
+		dds_tim_retune(DDS_TIMER1->tim, seq.entries[entry].period, seq.entries[entry].prescaler);
+		seq.retime = false;
+	}
+
+	if (!dds_seq_advance()) {
+		seq.end = true;
+		return;
+	}
+
+	seq.retime = seq.entry != entry;
+	DMA_MemoryTargetConfig(DMA1_Stream5, dds_seq_block_addr(), idle);
+}
+
 void DMA1_Stream5_IRQHandler(void)
 {
+	if (DMA_GetITStatus(DMA1_Stream5, DMA_IT_HTIF5) == SET) {
+		DMA_ClearITPendingBit(DMA1_Stream5, DMA_IT_HTIF5);
+
+		if (nco.active)
+			dds_nco_fill(nco_buf);
+	}
 	if (DMA_GetITStatus(DMA1_Stream5, DMA_IT_TCIF5) == SET) {
 		DMA_ClearITPendingBit(DMA1_Stream5, DMA_IT_TCIF5);
 
+		if (stream.ring)
+			dds_stream_refill();
+		else if (nco.active)
+			dds_nco_fill(nco_buf + DDS_NCO_BLOCK_SIZE);
+		else if (seq.active)
+			dds_seq_step();
+		else
+			dds_walk_step(&walk[0]);
+
 		// Transfer complete interrupt
 		if (likely(state.dds_sync))
 			state.dds_sync();
@@ -40,8 +494,35 @@ void DMA1_Stream5_IRQHandler(void)
 	}
 }
 
+void DMA1_Stream6_IRQHandler(void)
+{
+	if (DMA_GetITStatus(DMA1_Stream6, DMA_IT_TCIF6) == SET) {
+		DMA_ClearITPendingBit(DMA1_Stream6, DMA_IT_TCIF6);
+
+		dds_walk_step(&walk[1]);
+	}
+	if (DMA_GetITStatus(DMA1_Stream6, DMA_IT_DMEIF6) == SET) {
+		DMA_ClearITPendingBit(DMA1_Stream6, DMA_IT_DMEIF6);
+
+		// Direct mode error interrupt
+		if (likely(state.dds_err))
+			state.dds_err();
+	}
+	if (DMA_GetITStatus(DMA1_Stream6, DMA_IT_FEIF6) == SET) {
+		DMA_ClearITPendingBit(DMA1_Stream6, DMA_IT_FEIF6);
+
+		// FIFO error interrupt
+		if (likely(state.dds_err))
+			state.dds_err();
+	}
+}
+
 void TIM6_DAC_IRQHandler(void)
 {
+#ifndef DDS_TIMER_32BIT
+	dds_walk_update(TIM6);
+#endif
+
 	if (DAC_GetITStatus(DAC_Channel_1, DAC_IT_DMAUDR) == SET) {
 		DAC_ClearITPendingBit(DAC_Channel_1, DAC_IT_DMAUDR);
 
@@ -58,6 +539,23 @@ void TIM6_DAC_IRQHandler(void)
 	}
 }
 
+#ifdef DDS_TIMER_32BIT
+void TIM2_IRQHandler(void)
+{
+	dds_walk_update(TIM2);
+}
+
+void TIM5_IRQHandler(void)
+{
+	dds_walk_update(TIM5);
+}
+#else
+void TIM7_IRQHandler(void)
+{
+	dds_walk_update(TIM7);
+}
+#endif
+
 static const char *dds_res_str[] = {
 	"OK",
 	"invalid header",
@@ -66,6 +564,9 @@ static const char *dds_res_str[] = {
 	"invalid configuration",
 	"no enough memory",
 	"timeout",
+	"not cached",
+	"flash error",
+	"SD card error",
 };
 
 const char *dds_res_to_str(enum dds_res res)
@@ -81,16 +582,60 @@ bool dds_verify_header(dds_header *header)
 			header->magic[3] == 'M';
 }
 
-bool dds_verify_checksum(dds_header *header)
+bool dds_verify_header_v2(const dds_header_v2 *header)
 {
-	// TODO: verify checksum
+	return  header->magic[0] == 'M' &&
+			header->magic[1] == 'A' &&
+			header->magic[2] == 'R' &&
+			header->magic[3] == '2';
+}
 
-	return true;
+bool dds_verify_checksum(dds_header *header, uint32_t crc)
+{
+	/* zero checksum - not computed by client */
+	return header->checksum == 0 || header->checksum == crc;
+}
+
+static uint32_t dds_sample_width(uint8_t mode, enum dds_data_format format)
+{
+	if (mode == DDS_MODE_DUAL)
+		return (format == DDS_FORMAT_8bit) ? 2 : 4;
+
+	return (format == DDS_FORMAT_8bit) ? 1 : 2;
 }
 
 bool dds_verify_data(dds_header *header)
 {
-	// TODO verify data
+	uint32_t data_size;
+	int i;
+
+	if (header->size < sizeof(struct dds_header_struct))
+		return false;
+	data_size = header->size - sizeof(struct dds_header_struct);
+
+	for (i = 0; i < 2; i++) {
+		dds_chconfig *chc = &header->ch[i];
+		uint32_t width = dds_sample_width(DDS_MODE(header->mode), chc->data_format);
+
+		if (i == 1 && DDS_MODE(header->mode) == DDS_MODE_DUAL)
+			break;
+
+		if (!chc->enabled)
+			continue;
+
+		/* samples must lie within frame, aligned to DMA transfer size */
+		if (chc->data_offset > data_size || chc->data_size > (data_size - chc->data_offset) / width ||
+				((uint32_t) header->data + chc->data_offset) % width)
+			return false;
+
+		/* waveform must split into DMA segments */
+		if (!dds_wave_segments(chc->data_size))
+			return false;
+
+		/* period must fit timer ARR */
+		if (chc->period > dds_timer[i].max_period)
+			return false;
+	}
 
 	return true;
 }
@@ -126,6 +671,19 @@ static void dds_nvic_init(void)
 	nvic_init.NVIC_IRQChannelCmd = ENABLE;
 
 	NVIC_Init(&nvic_init);
+
+	nvic_init.NVIC_IRQChannel = DMA1_Stream6_IRQn;
+
+	NVIC_Init(&nvic_init);
+
+	/* sample clock update, retunes swapped waveform */
+	nvic_init.NVIC_IRQChannel = DDS_TIMER1->irq;
+
+	NVIC_Init(&nvic_init);
+
+	nvic_init.NVIC_IRQChannel = DDS_TIMER2->irq;
+
+	NVIC_Init(&nvic_init);
 }
 
 /* DHR registers offsets - copied from stm32f4xx_dac.c */
@@ -177,30 +735,44 @@ void DDS_Init(dds dds_struct)
 	RCC_AHB1PeriphClockCmd(RCC_AHB1Periph_GPIOA, ENABLE);
 	RCC_APB1PeriphClockCmd(RCC_APB1Periph_DAC, ENABLE);
 	RCC_AHB1PeriphClockCmd(RCC_AHB1Periph_DMA1, ENABLE);
-	RCC_APB1PeriphClockCmd(RCC_APB1Periph_TIM6, ENABLE);
-	RCC_APB1PeriphClockCmd(RCC_APB1Periph_TIM7, ENABLE);
+	RCC_APB1PeriphClockCmd(DDS_TIMER1->rcc, ENABLE);
+	RCC_APB1PeriphClockCmd(DDS_TIMER2->rcc, ENABLE);
 
 	dds_gpio_init();
 
 	dds_nvic_init();
+
+	dds_nco_lut_init();
 }
 
 void DDS_Stop(void)
 {
+	stream.ring = NULL;
+	nco.active = false;
+	seq.active = false;
+	sweep_active = false;
+	play.active = false;
+	walk[0].state = DDS_SWAP_IDLE;
+	walk[1].state = DDS_SWAP_IDLE;
+	walk[0].retime = false;
+	walk[1].retime = false;
+
 	DAC_DMACmd(DAC_Channel_1, DISABLE);
 	DAC_DMACmd(DAC_Channel_2, DISABLE);
 
 	DMA_DeInit(DMA1_Stream5);
 	DMA_DeInit(DMA1_Stream6);
+	DMA_DeInit(DDS_TIMER1->up_dma);
+	DMA_DeInit(DDS_TIMER2->up_dma);
 
 	DAC_Cmd(DAC_Channel_1, DISABLE);
 	DAC_Cmd(DAC_Channel_2, DISABLE);
 
-	TIM_DeInit(TIM6);
-	TIM_DeInit(TIM7);
+	TIM_DeInit(DDS_TIMER1->tim);
+	TIM_DeInit(DDS_TIMER2->tim);
 
-	TIM_Cmd(TIM6, DISABLE);
-	TIM_Cmd(TIM7, DISABLE);
+	TIM_Cmd(DDS_TIMER1->tim, DISABLE);
+	TIM_Cmd(DDS_TIMER2->tim, DISABLE);
 }
 
 static void dds_dac_config(uint32_t DAC_Channel, uint32_t DAC_Trigger)
@@ -226,14 +798,17 @@ static void dds_tim_config(TIM_TypeDef *TIMx, dds_chconfig *chconfig)
 	tim_init.TIM_CounterMode   = TIM_CounterMode_Up;
 
 	TIM_TimeBaseInit(TIMx, &tim_init);
+	TIM_ARRPreloadConfig(TIMx, ENABLE);
 	TIM_SelectOutputTrigger(TIMx, TIM_TRGOSource_Update);
 }
 
 static void dds_dma_config(DMA_Stream_TypeDef *DMAy_Streamx,
 					 	   uint32_t DMA_Channel,
-						   dds_header *header,
+						   uint8_t mode,
 						   dds_chconfig *chconfig,
-						   void *dds_dhr_addr)
+						   void *dds_dhr_addr,
+						   void *mem_addr,
+						   uint32_t count)
 {
 	DMA_InitTypeDef dma_init;
 	uint32_t periphDataSize;
@@ -243,29 +818,26 @@ static void dds_dma_config(DMA_Stream_TypeDef *DMAy_Streamx,
 
 	dma_init.DMA_Channel            = DMA_Channel;
 	dma_init.DMA_PeripheralBaseAddr = (uint32_t) dds_dhr_addr;
-	dma_init.DMA_Memory0BaseAddr    = ((uint32_t) header->data) + chconfig->data_offset;
+	dma_init.DMA_Memory0BaseAddr    = (uint32_t) mem_addr;
 	dma_init.DMA_DIR                = DMA_DIR_MemoryToPeripheral;
-	dma_init.DMA_BufferSize         = chconfig->data_size;
+	dma_init.DMA_BufferSize         = count;
 	dma_init.DMA_PeripheralInc      = DMA_PeripheralInc_Disable;
 	dma_init.DMA_MemoryInc          = DMA_MemoryInc_Enable;
 
 	// set peripherial and memory data size
-	if (header->mode == DDS_MODE_DUAL) {
-		if (chconfig->data_format == DDS_FORMAT_8bit) {
-			periphDataSize 	= DMA_PeripheralDataSize_HalfWord;
-			memDataSize		= DMA_MemoryDataSize_HalfWord;
-		} else {
-			periphDataSize 	= DMA_PeripheralDataSize_Word;
-			memDataSize		= DMA_MemoryDataSize_Word;
-		}
-	} else {
-		if (chconfig->data_format == DDS_FORMAT_8bit) {
-			periphDataSize 	= DMA_PeripheralDataSize_Byte;
-			memDataSize		= DMA_MemoryDataSize_Byte;
-		} else {
-			periphDataSize 	= DMA_PeripheralDataSize_HalfWord;
-			memDataSize		= DMA_MemoryDataSize_HalfWord;
-		}
+	switch (dds_sample_width(mode, chconfig->data_format)) {
+	case 1:
+		periphDataSize 	= DMA_PeripheralDataSize_Byte;
+		memDataSize		= DMA_MemoryDataSize_Byte;
+		break;
+	case 2:
+		periphDataSize 	= DMA_PeripheralDataSize_HalfWord;
+		memDataSize		= DMA_MemoryDataSize_HalfWord;
+		break;
+	default:
+		periphDataSize 	= DMA_PeripheralDataSize_Word;
+		memDataSize		= DMA_MemoryDataSize_Word;
+		break;
 	}
 
 	dma_init.DMA_PeripheralDataSize = periphDataSize;
@@ -281,6 +853,31 @@ static void dds_dma_config(DMA_Stream_TypeDef *DMAy_Streamx,
 	DMA_Init(DMAy_Streamx, &dma_init);
 }
 
+/*
+ * Memory targets hold current and next segment, TC interrupt walks the rest.
+ * Single segment plays in plain circular mode without interrupts.
+ */
+static void dds_dma_config_frame(DMA_Stream_TypeDef *DMAy_Streamx,
+								 dds_header *header,
+								 dds_chconfig *chconfig,
+								 void *dds_dhr_addr)
+{
+	struct dds_walk_struct *w = (DMAy_Streamx == DMA1_Stream5) ? &walk[0] : &walk[1];
+
+	dds_wave_split(&w->cur, ((uint8_t *) header->data) + chconfig->data_offset,
+				   chconfig->data_size, dds_sample_width(header->mode, chconfig->data_format));
+	w->next = 1 % w->cur.nseg;
+
+	dds_dma_config(DMAy_Streamx, DMA_Channel_7, header->mode, chconfig, dds_dhr_addr,
+				   (void *) dds_wave_segment(&w->cur, 0), w->cur.count);
+	if (w->cur.nseg > 1) {
+		DMA_DoubleBufferModeConfig(DMAy_Streamx, dds_wave_segment(&w->cur, w->next), DMA_Memory_0);
+		DMA_DoubleBufferModeCmd(DMAy_Streamx, ENABLE);
+		DMA_ITConfig(DMAy_Streamx, DMA_IT_TC, ENABLE);
+	}
+	DMA_Cmd(DMAy_Streamx, ENABLE);
+}
+
 static dds_res dds_run_independent(dds_header *header)
 {
 	void *hdr_addr;
@@ -291,31 +888,31 @@ static dds_res dds_run_independent(dds_header *header)
 	if (header->ch[0].enabled) {
 		dds_chconfig *chc = &header->ch[0];
 
-		dds_dac_config(DAC_Channel_1, DAC_Trigger_T6_TRGO);
+		dds_dac_config(DAC_Channel_1, DDS_TIMER1->dac_trigger);
+		DAC_Cmd(DAC_Channel_1, ENABLE);
 
-		// TIM6
-		RCC_APB1PeriphClockCmd(RCC_APB1Periph_TIM6, ENABLE);
-		dds_tim_config(TIM6, chc);
-		TIM_Cmd(TIM6, ENABLE);
+		// sample clock
+		RCC_APB1PeriphClockCmd(DDS_TIMER1->rcc, ENABLE);
+		dds_tim_config(DDS_TIMER1->tim, chc);
 
 		hdr_addr = dds_compute_dac_hdr_addr(1, chc->data_format);
-		dds_dma_config(DMA1_Stream5, DMA_Channel_7, header, chc, hdr_addr);
+		dds_dma_config_frame(DMA1_Stream5, header, chc, hdr_addr);
 		DAC_DMACmd(DAC_Channel_1, ENABLE);
 	}
 
 	// DAC channel2
 	if (header->ch[1].enabled) {
-		dds_chconfig *chc = &header->ch[0];
+		dds_chconfig *chc = &header->ch[1];
 
-		dds_dac_config(DAC_Channel_2, DAC_Trigger_T7_TRGO);
+		dds_dac_config(DAC_Channel_2, DDS_TIMER2->dac_trigger);
+		DAC_Cmd(DAC_Channel_2, ENABLE);
 
-		// TIM7
-		RCC_APB1PeriphClockCmd(RCC_APB1Periph_TIM7, ENABLE);
-		dds_tim_config(TIM7, chc);
-		TIM_Cmd(TIM7, ENABLE);
+		// channel 2 sample clock
+		RCC_APB1PeriphClockCmd(DDS_TIMER2->rcc, ENABLE);
+		dds_tim_config(DDS_TIMER2->tim, chc);
 
 		hdr_addr = dds_compute_dac_hdr_addr(2, chc->data_format);
-		dds_dma_config(DMA1_Stream6, DMA_Channel_7, header, chc, hdr_addr);
+		dds_dma_config_frame(DMA1_Stream6, header, chc, hdr_addr);
 		DAC_DMACmd(DAC_Channel_2, ENABLE);
 	}
 
@@ -333,31 +930,31 @@ static dds_res dds_run_single_trigger(dds_header *header)
 	if (header->ch[0].enabled) {
 		dds_chconfig *chc = &header->ch[0];
 
-		dds_dac_config(DAC_Channel_1, DAC_Trigger_T6_TRGO);
+		dds_dac_config(DAC_Channel_1, DDS_TIMER1->dac_trigger);
+		DAC_Cmd(DAC_Channel_1, ENABLE);
 
-		// TIM6
-		RCC_APB1PeriphClockCmd(RCC_APB1Periph_TIM6, ENABLE);
-		dds_tim_config(TIM6, &header->ch[0]);
-		TIM_Cmd(TIM6, ENABLE);
+		// sample clock
+		RCC_APB1PeriphClockCmd(DDS_TIMER1->rcc, ENABLE);
+		dds_tim_config(DDS_TIMER1->tim, &header->ch[0]);
 		trigger_configured = true;
 
 		hdr_addr = dds_compute_dac_hdr_addr(1, chc->data_format);
-		dds_dma_config(DMA1_Stream5, DMA_Channel_7, header, chc, hdr_addr);
+		dds_dma_config_frame(DMA1_Stream5, header, chc, hdr_addr);
 		DAC_DMACmd(DAC_Channel_1, ENABLE);
 	}
 
 	if (header->ch[1].enabled) {
 		dds_chconfig *chc = &header->ch[1];
 
-		dds_dac_config(DAC_Channel_2, DAC_Trigger_T6_TRGO);
+		dds_dac_config(DAC_Channel_2, DDS_TIMER1->dac_trigger);
+		DAC_Cmd(DAC_Channel_2, ENABLE);
 		if (!trigger_configured) {
-			// TIM6
-			RCC_APB1PeriphClockCmd(RCC_APB1Periph_TIM6, ENABLE);
-			dds_tim_config(TIM6, &header->ch[1]);
-			TIM_Cmd(TIM6, ENABLE);
+			// sample clock
+			RCC_APB1PeriphClockCmd(DDS_TIMER1->rcc, ENABLE);
+			dds_tim_config(DDS_TIMER1->tim, &header->ch[1]);
 		}
 		hdr_addr = dds_compute_dac_hdr_addr(2, chc->data_format);
-		dds_dma_config(DMA1_Stream6, DMA_Channel_7, header, chc, hdr_addr);
+		dds_dma_config_frame(DMA1_Stream6, header, chc, hdr_addr);
 		DAC_DMACmd(DAC_Channel_2, ENABLE);
 	}
 
@@ -373,33 +970,77 @@ static dds_res dds_run_dual(dds_header *header)
 
 	RCC_APB1PeriphClockCmd(RCC_APB1Periph_DAC, ENABLE);
 
-	dds_dac_config(DAC_Channel_1, DAC_Trigger_T6_TRGO);
-	dds_dac_config(DAC_Channel_2, DAC_Trigger_T6_TRGO);
+	dds_dac_config(DAC_Channel_1, DDS_TIMER1->dac_trigger);
+	dds_dac_config(DAC_Channel_2, DDS_TIMER1->dac_trigger);
+	DAC_Cmd(DAC_Channel_1, ENABLE);
+	DAC_Cmd(DAC_Channel_2, ENABLE);
 
-	// TIM6
-	RCC_APB1PeriphClockCmd(RCC_APB1Periph_TIM6, ENABLE);
-	dds_tim_config(TIM6, &header->ch[0]);
-	TIM_Cmd(TIM6, ENABLE);
+	// sample clock
+	RCC_APB1PeriphClockCmd(DDS_TIMER1->rcc, ENABLE);
+	dds_tim_config(DDS_TIMER1->tim, &header->ch[0]);
 
 	hdr_addr = dds_compute_dac_hdr_addr(3, header->ch[0].data_format);
-	dds_dma_config(DMA1_Stream5, DMA_Channel_7, header, &header->ch[0], hdr_addr);
+	dds_dma_config_frame(DMA1_Stream5, header, &header->ch[0], hdr_addr);
 	DAC_DMACmd(DAC_Channel_1, ENABLE);
 
-	DMA_ITConfig(DMA1_Stream5, DMA_IT_TC, ENABLE);
-
 	return DDS_OK;
 }
 
-int DDS_Start(dds_header *header)
+static void dds_rate_dma_config(const struct dds_timer_struct *timer,
+								void *table,
+								uint32_t count)
 {
-	dds_res res;
+	DMA_InitTypeDef dma_init;
+
+	DMA_DeInit(timer->up_dma);
+
+	DMA_StructInit(&dma_init);
+	dma_init.DMA_Channel            = timer->up_dma_channel;
+	dma_init.DMA_PeripheralBaseAddr = (uint32_t) &timer->tim->ARR;
+	dma_init.DMA_Memory0BaseAddr    = (uint32_t) table;
+	dma_init.DMA_DIR                = DMA_DIR_MemoryToPeripheral;
+	dma_init.DMA_BufferSize         = count;
+	dma_init.DMA_PeripheralInc      = DMA_PeripheralInc_Disable;
+	dma_init.DMA_MemoryInc          = DMA_MemoryInc_Enable;
+#ifdef DDS_TIMER_32BIT
+	dma_init.DMA_PeripheralDataSize = DMA_PeripheralDataSize_Word;
+	dma_init.DMA_MemoryDataSize     = DMA_MemoryDataSize_Word;
+#else
+	dma_init.DMA_PeripheralDataSize = DMA_PeripheralDataSize_HalfWord;
+	dma_init.DMA_MemoryDataSize     = DMA_MemoryDataSize_HalfWord;
+#endif
+	dma_init.DMA_Mode               = DMA_Mode_Circular;
+	dma_init.DMA_Priority           = DMA_Priority_High;
+
+	DMA_Init(timer->up_dma, &dma_init);
+	DMA_Cmd(timer->up_dma, ENABLE);
+
+	/* ARR is preloaded, value written on update n sets period n + 1 */
+	TIM_DMACmd(timer->tim, TIM_DMA_Update, ENABLE);
+}
+
+/* DMA streams and DACs are ready, sample clocks start last */
+static void dds_tim_start(dds_header *header)
+{
+	if (header->mode != DDS_MODE_INDEPENDENT || header->ch[0].enabled)
+		TIM_Cmd(DDS_TIMER1->tim, ENABLE);
+
+	if (header->mode == DDS_MODE_INDEPENDENT && header->ch[1].enabled)
+		TIM_Cmd(DDS_TIMER2->tim, ENABLE);
+}
 
-	if (unlikely(!dds_verify_checksum(header)))
-		return DDS_ERR_CHECKSUM;
+/* sweep - rate tables, written to ARR from first update event on */
+static int dds_start(dds_header *header, const dds_sweep_config *sweep)
+{
+	dds_res res = DDS_ERR_CONFIG;
+	int i;
 
 	if (unlikely(!dds_verify_data(header)))
 		return DDS_ERR_DATA;
 
+	/* start from scratch, DDS_Swap changes waveform without restart */
+	DDS_Stop();
+
 	if (!header->ch[0].enabled && !header->ch[1].enabled) {
 		DDS_Stop();
 		return DDS_OK;
@@ -422,5 +1063,581 @@ int DDS_Start(dds_header *header)
 		return res;
 	}
 
+	for (i = 0; sweep && i < 2; i++) {
+		if (sweep->ch[i].table_size)
+			dds_rate_dma_config(&dds_timer[i],
+								(uint8_t *) header->data + sweep->ch[i].table_offset,
+								sweep->ch[i].table_size);
+	}
+
+	dds_tim_start(header);
+
+	play.active = true;
+	play.mode = header->mode;
+	memcpy(play.ch, header->ch, sizeof(play.ch));
+
+	return DDS_OK;
+}
+
+int DDS_Start(dds_header *header)
+{
+	return dds_start(header, NULL);
+}
+
+/* finish switch still waiting for period end right away */
+void DDS_CompleteSwap(void)
+{
+	int i;
+
+	__disable_irq();
+
+	for (i = 0; i < 2; i++) {
+		struct dds_walk_struct *w = &walk[i];
+
+		/* rate of waveform already playing */
+		dds_walk_retime_pending(w);
+
+		if (w->state == DDS_SWAP_IDLE)
+			continue;
+
+		if (w->state == DDS_SWAP_PENDING)
+			w->cur = w->new;
+
+		dds_walk_retime(w);
+		dds_walk_restart(w);
+		w->state = DDS_SWAP_IDLE;
+	}
+
+	__enable_irq();
+}
+
+int DDS_Swap(dds_header *header)
+{
+	int i;
+
+	if (unlikely(!dds_verify_data(header)))
+		return DDS_ERR_DATA;
+
+	/* only the same channel layout can be switched without restart */
+	if (!play.active || sweep_active || header->mode != play.mode)
+		return DDS_Start(header);
+
+	for (i = 0; i < 2; i++) {
+		if (header->ch[i].enabled != play.ch[i].enabled ||
+				(header->ch[i].enabled &&
+				 header->ch[i].data_format != play.ch[i].data_format))
+			return DDS_Start(header);
+	}
+
+	DDS_CompleteSwap();
+
+	for (i = 0; i < 2; i++) {
+		dds_chconfig *chc = &header->ch[i];
+		struct dds_walk_struct *s = &walk[i];
+
+		/* dual mode plays both channels from DMA1_Stream5 */
+		if (!chc->enabled || (i == 1 && header->mode == DDS_MODE_DUAL))
+			continue;
+
+		dds_wave_split(&s->new, (uint8_t *) header->data + chc->data_offset,
+					   chc->data_size, dds_sample_width(header->mode, chc->data_format));
+
+		if (i == 0)
+			s->tim = DDS_TIMER1->tim;
+		else if (header->mode == DDS_MODE_INDEPENDENT)
+			s->tim = DDS_TIMER2->tim;
+		else
+			s->tim = header->ch[0].enabled ? NULL : DDS_TIMER1->tim;
+		s->period    = chc->period;
+		s->prescaler = chc->prescaler;
+
+		/* ISR must see new waveform before state */
+		__DMB();
+		s->state = DDS_SWAP_PENDING;
+
+		/* single segment waveform has no interrupt until now, wait for its next wrap */
+		if (s->cur.nseg == 1) {
+			DMA_ClearFlag(s->dma, s->tc_flag);
+			DMA_ITConfig(s->dma, DMA_IT_TC, ENABLE);
+		}
+	}
+
+	play.mode = header->mode;
+	memcpy(play.ch, header->ch, sizeof(play.ch));
+
+	return DDS_OK;
+}
+
+int DDS_StartStream(dds_header *header, struct dds_ring *ring)
+{
+	dds_chconfig *chc = &header->ch[0];
+	void *hdr_addr;
+
+	/* only DMA1_Stream5 is streamed, second channel needs dual mode */
+	if (unlikely(!chc->enabled ||
+			(header->ch[1].enabled && header->mode != DDS_MODE_DUAL)))
+		return DDS_ERR_CONFIG;
+
+	DDS_Stop();
+
+	stream.ring  = ring;
+	stream.width = dds_sample_width(header->mode, chc->data_format);
+	stream.underruns = 0;
+	stream.drain = 0;
+
+	memset(stream_buf, 0, sizeof(stream_buf));
+	dds_stream_fill(stream_buf[0]);
+	dds_stream_fill(stream_buf[1]);
+
+	RCC_APB1PeriphClockCmd(RCC_APB1Periph_DAC, ENABLE);
+
+	dds_dac_config(DAC_Channel_1, DDS_TIMER1->dac_trigger);
+	if (header->mode == DDS_MODE_DUAL)
+		dds_dac_config(DAC_Channel_2, DDS_TIMER1->dac_trigger);
+
+	// sample clock
+	RCC_APB1PeriphClockCmd(DDS_TIMER1->rcc, ENABLE);
+	dds_tim_config(DDS_TIMER1->tim, chc);
+
+	hdr_addr = dds_compute_dac_hdr_addr(header->mode == DDS_MODE_DUAL ? 3 : 1,
+										chc->data_format);
+	dds_dma_config(DMA1_Stream5, DMA_Channel_7, header->mode, chc, hdr_addr,
+				   stream_buf[0], DDS_STREAM_BLOCK_SIZE / stream.width);
+	DMA_DoubleBufferModeConfig(DMA1_Stream5, (uint32_t) stream_buf[1], DMA_Memory_0);
+	DMA_DoubleBufferModeCmd(DMA1_Stream5, ENABLE);
+	DMA_ITConfig(DMA1_Stream5, DMA_IT_TC, ENABLE);
+	DMA_Cmd(DMA1_Stream5, ENABLE);
+
+	DAC_Cmd(DAC_Channel_1, ENABLE);
+	if (header->mode == DDS_MODE_DUAL)
+		DAC_Cmd(DAC_Channel_2, ENABLE);
+	DAC_DMACmd(DAC_Channel_1, ENABLE);
+	TIM_Cmd(DDS_TIMER1->tim, ENABLE);
+
+	return DDS_OK;
+}
+
+uint32_t DDS_StreamUnderruns(void)
+{
+	return stream.underruns;
+}
+
+bool DDS_StreamActive(void)
+{
+	return stream.ring != NULL;
+}
+
+/* bytes per second DDS_StartStream takes from the ring */
+uint32_t DDS_StreamByteRate(const dds_header *header)
+{
+	const dds_chconfig *chc = &header->ch[0];
+	uint64_t div = (uint64_t) (chc->period + 1) * (chc->prescaler + 1);
+
+	return (uint64_t) DDS_TimerClock() * dds_sample_width(header->mode, chc->data_format) / div;
+}
+
+int DDS_StartNco(dds_header *header, const dds_nco_config *nco_config)
+{
+	dds_chconfig chc = header->ch[0];
+	void *hdr_addr;
+
+	/* NCO drives DAC channel 1 from DMA1_Stream5 */
+	if (unlikely(!chc.enabled || header->ch[1].enabled))
+		return DDS_ERR_CONFIG;
+
+	/* same sample clock, retune without breaking phase */
+	if (nco.active && nco.period == chc.period && nco.prescaler == chc.prescaler) {
+		DDS_SetTuningWord(nco_config->tuning_word);
+		return DDS_OK;
+	}
+
+	DDS_Stop();
+
+	nco.phase = 0;
+	nco.tuning_word = nco_config->tuning_word;
+	nco.period = chc.period;
+	nco.prescaler = chc.prescaler;
+
+	dds_nco_fill(nco_buf);
+	dds_nco_fill(nco_buf + DDS_NCO_BLOCK_SIZE);
+
+	RCC_APB1PeriphClockCmd(RCC_APB1Periph_DAC, ENABLE);
+	dds_dac_config(DAC_Channel_1, DDS_TIMER1->dac_trigger);
+
+	// sample clock
+	RCC_APB1PeriphClockCmd(DDS_TIMER1->rcc, ENABLE);
+	dds_tim_config(DDS_TIMER1->tim, &chc);
+
+	/* LUT holds 12-bit right aligned samples regardless of data_format */
+	chc.data_format = DDS_FORMAT_12bit_RIGHT;
+	hdr_addr = dds_compute_dac_hdr_addr(1, chc.data_format);
+	dds_dma_config(DMA1_Stream5, DMA_Channel_7, DDS_MODE_INDEPENDENT, &chc, hdr_addr,
+				   nco_buf, 2 * DDS_NCO_BLOCK_SIZE);
+	DMA_ITConfig(DMA1_Stream5, DMA_IT_HT | DMA_IT_TC, ENABLE);
+	DMA_Cmd(DMA1_Stream5, ENABLE);
+
+	nco.active = true;
+
+	DAC_Cmd(DAC_Channel_1, ENABLE);
+	DAC_DMACmd(DAC_Channel_1, ENABLE);
+	TIM_Cmd(DDS_TIMER1->tim, ENABLE);
+
+	return DDS_OK;
+}
+
+void DDS_SetTuningWord(uint32_t tuning_word)
+{
+	/* picked up by next block fill */
+	nco.tuning_word = tuning_word;
+}
+
+bool DDS_NcoActive(void)
+{
+	return nco.active;
+}
+
+/* one sample of shape at given phase, Q15 */
+static int32_t dds_synth_sample(uint8_t shape, uint32_t phase)
+{
+	int32_t p = phase >> 16;
+
+	switch (shape) {
+	case DDS_SHAPE_SINE:
+		return ((int32_t) nco_lut[phase >> (32 - DDS_NCO_LUT_BITS)] - 2048) << 4;
+	case DDS_SHAPE_SQUARE:
+		return (phase < 0x80000000) ? 32767 : -32768;
+	case DDS_SHAPE_TRIANGLE:
+		return (p < 32768) ? 2 * p - 32768 : 98303 - 2 * p;
+	default:
+		return p - 32768;
+	}
+}
+
+int DDS_Synthesize(const dds_synth_config *synth, enum dds_data_format format, void *buf)
+{
+	uint32_t length = synth->length;
+	uint32_t phase = synth->phase;
+	uint32_t step, rem, err = 0;
+	uint32_t i;
+
+	if (unlikely(length == 0 || synth->shape > DDS_SHAPE_SAW))
+		return DDS_ERR_CONFIG;
+
+	/* 2^32 / length split so that phase wraps exactly after one period */
+	step = (uint32_t) ((1ULL << 32) / length);
+	rem  = (uint32_t) ((1ULL << 32) % length);
+
+	for (i = 0; i < length; i++) {
+		int32_t v = synth->offset +
+				((synth->amplitude * dds_synth_sample(synth->shape, phase)) >> 15);
+
+		if (v < 0)
+			v = 0;
+		if (v > 4095)
+			v = 4095;
+
+		switch (format) {
+		case DDS_FORMAT_8bit:
+			((uint8_t *) buf)[i] = v >> 4;
+			break;
+		case DDS_FORMAT_12bit_LEFT:
+			((uint16_t *) buf)[i] = v << 4;
+			break;
+		case DDS_FORMAT_12bit_RIGHT:
+			((uint16_t *) buf)[i] = v;
+			break;
+		}
+
+		phase += step;
+		err += rem;
+		if (err >= length) {
+			err -= length;
+			phase++;
+		}
+	}
+
+	return DDS_OK;
+}
+
+static uint32_t dds_gcd(uint32_t a, uint32_t b)
+{
+	while (b) {
+		uint32_t t = a % b;
+		a = b;
+		b = t;
+	}
+
+	return a;
+}
+
+int DDS_StartSequence(dds_header *header)
+{
+	const dds_seq_config *config = (const dds_seq_config *) header->data;
+	const dds_seq_entry *entries = (const dds_seq_entry *) (config + 1);
+	dds_chconfig chc = header->ch[0];
+	uint8_t mode = DDS_MODE(header->mode);
+	uint32_t width = dds_sample_width(mode, chc.data_format);
+	uint32_t data_size = header->size - sizeof(struct dds_header_struct);
+	uint32_t gcd = 0;
+	uint16_t nseg;
+	void *hdr_addr;
+	int i;
+
+	/* sequence is played by DMA1_Stream5, second channel needs dual mode */
+	if (unlikely(!chc.enabled || (header->ch[1].enabled && mode != DDS_MODE_DUAL)))
+		return DDS_ERR_CONFIG;
+
+	if (unlikely(config->nentries == 0 ||
+			sizeof(*config) + config->nentries * sizeof(*entries) > data_size))
+		return DDS_ERR_HEADER;
+
+	for (i = 0; i < config->nentries; i++) {
+		const dds_seq_entry *e = &entries[i];
+		uint32_t addr = (uint32_t) header->data + e->data_offset;
+
+		if (unlikely(e->data_size == 0 || addr % width ||
+				e->data_offset > data_size || e->data_size > (data_size - e->data_offset) / width))
+			return DDS_ERR_DATA;
+
+		if (unlikely(e->next != DDS_SEQ_END && e->next >= config->nentries))
+			return DDS_ERR_CONFIG;
+
+		if (unlikely(e->period > DDS_TIMER1->max_period))
+			return DDS_ERR_CONFIG;
+
+		gcd = dds_gcd(gcd, e->data_size);
+	}
+
+	/* one block length for all entries keeps NDTR fixed, interrupt must reload each block in time */
+	nseg = dds_wave_segments(gcd);
+	if (unlikely(!nseg || gcd < DDS_SEGMENT_MIN_SIZE))
+		return DDS_ERR_DATA;
+
+	DDS_Stop();
+
+	seq.entries 	= entries;
+	seq.data 		= (uint8_t *) header->data;
+	seq.count 		= gcd / nseg;
+	seq.block_size 	= seq.count * width;
+	seq.entry 		= 0;
+	seq.block 		= 0;
+	seq.pass 		= 0;
+	seq.retime 		= false;
+	seq.end 		= false;
+
+	RCC_APB1PeriphClockCmd(RCC_APB1Periph_DAC, ENABLE);
+
+	dds_dac_config(DAC_Channel_1, DDS_TIMER1->dac_trigger);
+	DAC_Cmd(DAC_Channel_1, ENABLE);
+	if (mode == DDS_MODE_DUAL) {
+		dds_dac_config(DAC_Channel_2, DDS_TIMER1->dac_trigger);
+		DAC_Cmd(DAC_Channel_2, ENABLE);
+	}
+
+	// sample clock at rate of first entry
+	chc.period = entries[0].period;
+	chc.prescaler = entries[0].prescaler;
+	RCC_APB1PeriphClockCmd(DDS_TIMER1->rcc, ENABLE);
+	dds_tim_config(DDS_TIMER1->tim, &chc);
+
+	hdr_addr = dds_compute_dac_hdr_addr(mode == DDS_MODE_DUAL ? 3 : 1, chc.data_format);
+	dds_dma_config(DMA1_Stream5, DMA_Channel_7, mode, &chc, hdr_addr,
+				   (void *) dds_seq_block_addr(), seq.count);
+
+	/* second block goes to the other memory target */
+	seq.end = !dds_seq_advance();
+	seq.retime = seq.entry != 0;
+	DMA_DoubleBufferModeConfig(DMA1_Stream5, dds_seq_block_addr(), DMA_Memory_0);
+	DMA_DoubleBufferModeCmd(DMA1_Stream5, ENABLE);
+	DMA_ITConfig(DMA1_Stream5, DMA_IT_TC, ENABLE);
+	DMA_Cmd(DMA1_Stream5, ENABLE);
+
+	seq.active = true;
+
+	DAC_DMACmd(DAC_Channel_1, ENABLE);
+	TIM_Cmd(DDS_TIMER1->tim, ENABLE);
+
+	return DDS_OK;
+}
+
+/* uint32_t periods of sweep frame become dds_period_t ARR values, false if one doesn't fit */
+static bool dds_sweep_table(void *table, uint32_t count, uint32_t max_period)
+{
+	const uint16_t *half = table;
+	dds_period_t *period = table;
+	uint32_t i;
+
+	/* each value is read before anything at or past it is written */
+	for (i = 0; i < count; i++) {
+		uint32_t v = half[2 * i] | (uint32_t) half[2 * i + 1] << 16;
+
+		if (unlikely(v > max_period))
+			return false;
+
+		period[i] = v;
+	}
+
+	return true;
+}
+
+int DDS_StartSweep(dds_header *header)
+{
+	const dds_sweep_config *sweep = (const dds_sweep_config *) header->data;
+	uint32_t data_size = header->size - sizeof(struct dds_header_struct);
+	dds_res res;
+	int i;
+
+	header->mode = DDS_MODE(header->mode);
+
+	for (i = 0; i < 2; i++) {
+		uint32_t offset = sweep->ch[i].table_offset;
+		uint32_t count = sweep->ch[i].table_size;
+
+		if (count == 0)
+			continue;
+
+		/* second timer paces channel 2 only in independent mode */
+		if (unlikely(i == 1 && header->mode != DDS_MODE_INDEPENDENT))
+			return DDS_ERR_CONFIG;
+
+		if (unlikely(count > 0xffff || ((uint32_t) header->data + offset) % sizeof(uint32_t) ||
+				offset > data_size || count > (data_size - offset) / sizeof(uint32_t)))
+			return DDS_ERR_DATA;
+
+		/* channels may share one table, it is narrowed once */
+		if (i == 1 && sweep->ch[0].table_size && offset == sweep->ch[0].table_offset &&
+				count <= sweep->ch[0].table_size)
+			continue;
+
+		if (unlikely(!dds_sweep_table((uint8_t *) header->data + offset, count, dds_timer[i].max_period)))
+			return DDS_ERR_DATA;
+	}
+
+	res = dds_start(header, sweep);
+	if (res != DDS_OK)
+		return res;
+
+	sweep_active = true;
+
+	return DDS_OK;
+}
+
+int DDS_Retune(dds_header *header)
+{
+	/* ARR belongs to rate DMA during sweep */
+	if (unlikely(sweep_active))
+		return DDS_ERR_CONFIG;
+
+	if (unlikely(!play.active && !seq.active && !stream.ring && !nco.active))
+		return DDS_ERR_CONFIG;
+
+	/* second timer only runs for channel 2 of independent mode */
+	if (unlikely(header->ch[1].enabled &&
+			(!play.active || play.mode != DDS_MODE_INDEPENDENT)))
+		return DDS_ERR_CONFIG;
+
+	if (unlikely((header->ch[0].enabled && header->ch[0].period > DDS_TIMER1->max_period) ||
+			(header->ch[1].enabled && header->ch[1].period > DDS_TIMER2->max_period)))
+		return DDS_ERR_CONFIG;
+
+	if (header->ch[0].enabled) {
+		dds_tim_retune(DDS_TIMER1->tim, header->ch[0].period, header->ch[0].prescaler);
+
+		nco.period = header->ch[0].period;
+		nco.prescaler = header->ch[0].prescaler;
+	}
+
+	if (header->ch[1].enabled)
+		dds_tim_retune(DDS_TIMER2->tim, header->ch[1].period, header->ch[1].prescaler);
+
+	return DDS_OK;
+}
+
+uint32_t DDS_TimerClock(void)
+{
+	RCC_ClocksTypeDef clocks;
+
+	RCC_GetClocksFreq(&clocks);
+
+	/* APB1 timers run at twice PCLK1 unless APB1 is not divided */
+	if ((RCC->CFGR & RCC_CFGR_PPRE1) == RCC_CFGR_PPRE1_DIV1)
+		return clocks.PCLK1_Frequency;
+
+	return 2 * clocks.PCLK1_Frequency;
+}
+
+uint64_t DDS_SolveRate(uint64_t rate_mhz, uint32_t *period, uint16_t *prescaler)
+{
+	uint64_t num = (uint64_t) DDS_TimerClock() * 1000;
+	uint64_t best_err = UINT64_MAX;
+	uint64_t ticks;
+	uint32_t dmin, d;
+
+	if (unlikely(rate_mhz == 0 || rate_mhz > num))
+		return 0;
+
+	/* timer ticks per sample, rounded */
+	ticks = (num + rate_mhz / 2) / rate_mhz;
+
+	/* smallest divider keeping period within ARR */
+	dmin = (ticks + DDS_TIMER1->max_period) / ((uint64_t) DDS_TIMER1->max_period + 1);
+	if (dmin == 0)
+		dmin = 1;
+
+	/*
+	 * Rate is clk / (d * (arr + 1)), try dividers near the smallest one
+	 * and keep the one whose rate is closest to the wanted one.
+	 */
+	for (d = dmin; d <= 0x10000 && d < dmin + 1024; d++) {
+		uint64_t n = (num + rate_mhz * d / 2) / (rate_mhz * d);
+		uint64_t err;
+
+		/* ARR of 0 stops the counter */
+		if (n < 2 || n > (uint64_t) DDS_TIMER1->max_period + 1)
+			continue;
+
+		err = rate_mhz * d * n;
+		err = err > num ? err - num : num - err;
+
+		if (err < best_err) {
+			best_err   = err;
+			*period    = n - 1;
+			*prescaler = d - 1;
+		}
+
+		if (err == 0)
+			break;
+	}
+
+	if (best_err == UINT64_MAX)
+		return 0;
+
+	return (num + (uint64_t) (*prescaler + 1) * (*period + 1) / 2) /
+			((uint64_t) (*prescaler + 1) * (*period + 1));
+}
+
+/* DDS_FLAG_RATE: replace sample rates in ch[].period with timer settings */
+int DDS_SolveRates(dds_header *header, uint32_t rate[2])
+{
+	int i;
+
+	for (i = 0; i < 2; i++) {
+		uint32_t period;
+		uint16_t prescaler;
+		uint64_t achieved;
+
+		rate[i] = 0;
+		if (!header->ch[i].enabled)
+			continue;
+
+		achieved = DDS_SolveRate(header->ch[i].period, &period, &prescaler);
+		if (unlikely(achieved == 0 || achieved > UINT32_MAX))
+			return DDS_ERR_CONFIG;
+
+		rate[i] = achieved;
+		header->ch[i].period = period;
+		header->ch[i].prescaler = prescaler;
+	}
+
 	return DDS_OK;
 }
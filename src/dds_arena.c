@@ -0,0 +1,50 @@
+/*
+ * dds_arena.c
+ *
+ *      Blocks are handed out from the top of the arena down and are
+ *      only given back all at once by dds_arena_reset().
+ */
+
+#include <stdint.h>
+
+#include "dds_arena.h"
+
+#define DDS_ARENA_ALIGN		8
+
+/* defined in LinkerScript.ld */
+extern uint8_t _sdds_arena[];
+extern uint8_t _edds_arena[];
+
+static uint8_t *arena_top;
+
+void dds_arena_init(void)
+{
+	arena_top = _edds_arena;
+}
+
+size_t dds_arena_capacity(void)
+{
+	return _edds_arena - _sdds_arena;
+}
+
+size_t dds_arena_available(void)
+{
+	return arena_top - _sdds_arena;
+}
+
+void *dds_arena_alloc(size_t size)
+{
+	size = (size + DDS_ARENA_ALIGN - 1) & ~(DDS_ARENA_ALIGN - 1);
+
+	if (size > dds_arena_available())
+		return NULL;
+
+	arena_top -= size;
+
+	return arena_top;
+}
+
+void dds_arena_reset(void)
+{
+	arena_top = _edds_arena;
+}
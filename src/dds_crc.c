@@ -0,0 +1,69 @@
+/*
+ * dds_crc.c
+ *
+ *      CRC unit only takes whole words, pbufs don't end on word boundary,
+ *      so up to three bytes are carried over to the next update.
+ */
+
+#include <string.h>
+
+#include "stm32f4xx.h"
+
+#include "dds_crc.h"
+
+static uint32_t crc_carry;			/* bytes waiting for whole word */
+static size_t crc_carry_len;
+
+void dds_crc_init(void)
+{
+	RCC_AHB1PeriphClockCmd(RCC_AHB1Periph_CRC, ENABLE);
+
+	dds_crc_reset();
+}
+
+void dds_crc_reset(void)
+{
+	CRC_ResetDR();
+
+	crc_carry = 0;
+	crc_carry_len = 0;
+}
+
+void dds_crc_update(const void *data, size_t len)
+{
+	const uint8_t *p = data;
+	uint32_t word;
+
+	/* complete word left from previous update */
+	while (crc_carry_len && len) {
+		crc_carry |= (uint32_t) *p++ << (8 * crc_carry_len);
+		len--;
+
+		if (++crc_carry_len == 4) {
+			CRC->DR = crc_carry;
+			crc_carry = 0;
+			crc_carry_len = 0;
+		}
+	}
+
+	for (; len >= 4; p += 4, len -= 4) {
+		/* payload is not necessarily aligned */
+		memcpy(&word, p, sizeof(word));
+		CRC->DR = word;
+	}
+
+	while (len--)
+		crc_carry |= (uint32_t) *p++ << (8 * crc_carry_len++);
+}
+
+uint32_t dds_crc_final(void)
+{
+	/* pad last word with zeros */
+	if (crc_carry_len) {
+		CRC->DR = crc_carry;
+		crc_carry = 0;
+		crc_carry_len = 0;
+	}
+
+	return CRC->DR;
+}
@@ -0,0 +1,112 @@
+/*
+ * dds_flash.c
+ *
+ *      Record header is programmed after the data it describes, so a save
+ *      interrupted by reset leaves erased magic and nothing is restored.
+ *      Erasing stalls code fetch from flash for a second or two.
+ */
+
+#include "stm32f4xx.h"
+#include "stm32f4xx_flash.h"
+
+#include "dds_crc.h"
+#include "dds_flash.h"
+
+#define DDS_FLASH_SECTOR	FLASH_Sector_11
+#define DDS_FLASH_ADDR		0x080E0000
+#define DDS_FLASH_SIZE		0x20000
+
+#define DDS_FLASH_MAGIC		0x4652414d		/* "MARF" */
+
+struct dds_flash_record {
+	uint32_t		magic;			/* DDS_FLASH_MAGIC, erased if empty 	*/
+	uint32_t		size;			/* bytes of data 						*/
+	uint32_t		offset;			/* caller defined, restored with data 	*/
+	uint32_t		crc;			/* of data 								*/
+};
+
+#define DDS_FLASH_RECORD	((const struct dds_flash_record *) DDS_FLASH_ADDR)
+#define DDS_FLASH_DATA		(DDS_FLASH_ADDR + sizeof(struct dds_flash_record))
+
+static uint32_t dds_flash_crc(const void *data, size_t size)
+{
+	dds_crc_reset();
+	dds_crc_update(data, size);
+
+	return dds_crc_final();
+}
+
+size_t dds_flash_capacity(void)
+{
+	return DDS_FLASH_SIZE - sizeof(struct dds_flash_record);
+}
+
+bool dds_flash_erase(void)
+{
+	FLASH_Status status;
+
+	FLASH_Unlock();
+	FLASH_ClearFlag(FLASH_FLAG_EOP | FLASH_FLAG_OPERR | FLASH_FLAG_WRPERR |
+			FLASH_FLAG_PGAERR | FLASH_FLAG_PGPERR | FLASH_FLAG_PGSERR);
+
+	status = FLASH_EraseSector(DDS_FLASH_SECTOR, VoltageRange_3);
+
+	FLASH_Lock();
+
+	return status == FLASH_COMPLETE;
+}
+
+bool dds_flash_save(const void *data, size_t size, uint32_t offset)
+{
+	const uint8_t *p = data;
+	uint32_t addr, word;
+	FLASH_Status status = FLASH_COMPLETE;
+	size_t i;
+
+	if (size > dds_flash_capacity() || !dds_flash_erase())
+		return false;
+
+	FLASH_Unlock();
+
+	for (i = 0, addr = DDS_FLASH_DATA; i < size && status == FLASH_COMPLETE; i += 4, addr += 4) {
+		word = p[i];
+		if (i + 1 < size)
+			word |= (uint32_t) p[i + 1] << 8;
+		if (i + 2 < size)
+			word |= (uint32_t) p[i + 2] << 16;
+		if (i + 3 < size)
+			word |= (uint32_t) p[i + 3] << 24;
+
+		status = FLASH_ProgramWord(addr, word);
+	}
+
+	if (status == FLASH_COMPLETE)
+		status = FLASH_ProgramWord(DDS_FLASH_ADDR + offsetof(struct dds_flash_record, size), size);
+	if (status == FLASH_COMPLETE)
+		status = FLASH_ProgramWord(DDS_FLASH_ADDR + offsetof(struct dds_flash_record, offset), offset);
+	if (status == FLASH_COMPLETE)
+		status = FLASH_ProgramWord(DDS_FLASH_ADDR + offsetof(struct dds_flash_record, crc),
+				dds_flash_crc(data, size));
+	if (status == FLASH_COMPLETE)
+		status = FLASH_ProgramWord(DDS_FLASH_ADDR, DDS_FLASH_MAGIC);
+
+	FLASH_Lock();
+
+	return status == FLASH_COMPLETE;
+}
+
+const void *dds_flash_load(size_t *size, uint32_t *offset)
+{
+	const struct dds_flash_record *record = DDS_FLASH_RECORD;
+
+	if (record->magic != DDS_FLASH_MAGIC || record->size > dds_flash_capacity())
+		return NULL;
+
+	if (dds_flash_crc((const void *) DDS_FLASH_DATA, record->size) != record->crc)
+		return NULL;
+
+	*size = record->size;
+	*offset = record->offset;
+
+	return (const void *) DDS_FLASH_DATA;
+}
@@ -0,0 +1,114 @@
+/*
+ * dds_ring.c
+ *
+ *      Head and tail are free running counters, only the producer moves
+ *      head and only the consumer moves tail, so no locking is needed
+ *      between the main loop and the DMA interrupt.
+ */
+
+#include <string.h>
+
+#include "stm32f4xx.h"
+
+#include "dds_ring.h"
+
+void dds_ring_init(struct dds_ring *ring, void *buf, size_t size)
+{
+	ring->buf  = buf;
+	ring->size = size;
+	ring->head = 0;
+	ring->tail = 0;
+	ring->eof  = false;
+}
+
+size_t dds_ring_used(const struct dds_ring *ring)
+{
+	return ring->head - ring->tail;
+}
+
+size_t dds_ring_space(const struct dds_ring *ring)
+{
+	return ring->size - (ring->head - ring->tail);
+}
+
+size_t dds_ring_write(struct dds_ring *ring, const void *data, size_t len)
+{
+	size_t head = ring->head;
+	size_t pos  = head & (ring->size - 1);
+	size_t space = dds_ring_space(ring);
+	size_t chunk;
+
+	if (len > space)
+		len = space;
+
+	chunk = ring->size - pos;
+	if (chunk > len)
+		chunk = len;
+
+	memcpy(ring->buf + pos, data, chunk);
+	memcpy(ring->buf, (const uint8_t *) data + chunk, len - chunk);
+
+	/* publish data before moving head */
+	__DMB();
+	ring->head = head + len;
+
+	return len;
+}
+
+size_t dds_ring_read(struct dds_ring *ring, void *data, size_t len)
+{
+	size_t tail = ring->tail;
+	size_t pos  = tail & (ring->size - 1);
+	size_t used = dds_ring_used(ring);
+	size_t chunk;
+
+	if (len > used)
+		len = used;
+
+	chunk = ring->size - pos;
+	if (chunk > len)
+		chunk = len;
+
+	memcpy(data, ring->buf + pos, chunk);
+	memcpy((uint8_t *) data + chunk, ring->buf, len - chunk);
+
+	/* consume data before releasing space */
+	__DMB();
+	ring->tail = tail + len;
+
+	return len;
+}
+
+/* contiguous free space at head, for producers filling the ring in place by DMA */
+size_t dds_ring_write_span(struct dds_ring *ring, void **data)
+{
+	size_t pos = ring->head & (ring->size - 1);
+	size_t space = dds_ring_space(ring);
+
+	*data = ring->buf + pos;
+
+	return (space < ring->size - pos) ? space : ring->size - pos;
+}
+
+void dds_ring_produce(struct dds_ring *ring, size_t len)
+{
+	__DMB();
+	ring->head += len;
+}
+
+/* contiguous data at tail, for consumers taking it out in place by DMA */
+size_t dds_ring_read_span(struct dds_ring *ring, const void **data)
+{
+	size_t pos = ring->tail & (ring->size - 1);
+	size_t used = dds_ring_used(ring);
+
+	*data = ring->buf + pos;
+
+	return (used < ring->size - pos) ? used : ring->size - pos;
+}
+
+void dds_ring_consume(struct dds_ring *ring, size_t len)
+{
+	__DMB();
+	ring->tail += len;
+}
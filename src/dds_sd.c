@@ -0,0 +1,443 @@
+/*
+ * dds_sd.c
+ *
+ *      Card starts with a log head block followed by entries, each a
+ *      descriptor block and the data blocks after it; the newest entry
+ *      of an ID wins. Data is written before its descriptor, so a save
+ *      interrupted by reset is not part of the log. Entries left over
+ *      from before the last format carry another generation and end the
+ *      scan. Deleting appends an entry without data, space is reclaimed
+ *      by formatting only. Stream entries keep the frame header in their
+ *      first data block and samples from the next one on; they are written
+ *      as they arrive, so they carry no CRC.
+ */
+
+#include <string.h>
+
+#include "stm32f4xx.h"
+#include "stm32f4_discovery_sdio_sd.h"
+
+#include "dds_crc.h"
+#include "dds_sd.h"
+
+/* log head, card is not shared with a file system */
+#ifndef DDS_SD_FIRST_BLOCK
+ #define DDS_SD_FIRST_BLOCK	0
+#endif
+
+#define DDS_SD_HEAD_MAGIC	0x4c52414d		/* "MARL" */
+#define DDS_SD_ENTRY_MAGIC	0x5352414d		/* "MARS" */
+
+/* BSP takes 32-bit byte addresses */
+#define DDS_SD_MAX_BLOCKS	(0xffffffffUL / DDS_SD_BLOCK)
+
+#define DDS_SD_FLAG_STREAM	0x01			/* header block, then samples 			*/
+
+struct dds_sd_head {
+	uint32_t		magic;			/* DDS_SD_HEAD_MAGIC 					*/
+	uint32_t		generation;		/* bumped by every format, never 0 		*/
+};
+
+struct dds_sd_entry {
+	uint32_t		magic;			/* DDS_SD_ENTRY_MAGIC 					*/
+	uint32_t		generation;		/* of log head 							*/
+	uint32_t		seq;			/* entries before this one 				*/
+	uint8_t			id;				/* waveform ID 							*/
+	uint8_t			flags;			/* DDS_SD_FLAG_* 						*/
+	uint8_t			reserved[2];
+	uint32_t		size;			/* bytes of data, 0 - ID deleted 		*/
+	uint32_t		offset;			/* caller defined, restored with data 	*/
+	uint32_t		crc;			/* of data 								*/
+	uint32_t		entry_crc;		/* of fields above 						*/
+};
+
+/* log head and descriptors go through here, SDIO DMA moves bursts of four words */
+static uint32_t dds_sd_block[DDS_SD_BLOCK / 4] __attribute__ ((aligned (16)));
+
+static uint32_t dds_sd_index[DDS_SD_IDS];	/* descriptor block of ID, 0 - none */
+static uint32_t dds_sd_blocks;		/* card size, 0 - no card */
+static uint32_t dds_sd_generation;	/* of mounted log, 0 - not formatted */
+static uint32_t dds_sd_seq;			/* entries in log */
+static uint32_t dds_sd_next;		/* block of next descriptor */
+
+/* stream being recorded right behind the log, descriptor follows once complete */
+static uint8_t  dds_sd_rec_id;
+static uint32_t dds_sd_rec_next;	/* next data block, 0 - not recording */
+
+/* stream being played */
+static uint32_t dds_sd_play_next;	/* next sample block */
+static uint32_t dds_sd_play_end;	/* first block past the entry */
+
+void SDIO_IRQHandler(void)
+{
+	SD_ProcessIRQSrc();
+}
+
+void SD_SDIO_DMA_IRQHANDLER(void)
+{
+	SD_ProcessDMAIRQ();
+}
+
+static void dds_sd_nvic_init(void)
+{
+	NVIC_InitTypeDef      nvic_init;
+
+	/* below DAC DMA, a late sample is worse than a slow load */
+	nvic_init.NVIC_IRQChannel = SDIO_IRQn;
+	nvic_init.NVIC_IRQChannelPreemptionPriority = 1;
+	nvic_init.NVIC_IRQChannelSubPriority = 0;
+	nvic_init.NVIC_IRQChannelCmd = ENABLE;
+
+	NVIC_Init(&nvic_init);
+
+	nvic_init.NVIC_IRQChannel = SD_SDIO_DMA_IRQn;
+
+	NVIC_Init(&nvic_init);
+}
+
+static uint32_t dds_sd_crc(const void *data, size_t size)
+{
+	dds_crc_reset();
+	dds_crc_update(data, size);
+
+	return dds_crc_final();
+}
+
+/* card left transfer state, SD_GetStatus() reports removed card as error */
+static bool dds_sd_wait(void)
+{
+	SDTransferState state;
+
+	do {
+		state = SD_GetStatus();
+	} while (state == SD_TRANSFER_BUSY);
+
+	return state == SD_TRANSFER_OK;
+}
+
+static bool dds_sd_read(void *data, uint32_t block, uint32_t count)
+{
+	if (SD_ReadMultiBlocks(data, block * DDS_SD_BLOCK, DDS_SD_BLOCK, count) != SD_OK)
+		return false;
+
+	if (SD_WaitReadOperation() != SD_OK)
+		return false;
+
+	return dds_sd_wait();
+}
+
+static bool dds_sd_write(const void *data, uint32_t block, uint32_t count)
+{
+	if (SD_WriteMultiBlocks((uint8_t *) data, block * DDS_SD_BLOCK, DDS_SD_BLOCK, count) != SD_OK)
+		return false;
+
+	if (SD_WaitWriteOperation() != SD_OK)
+		return false;
+
+	return dds_sd_wait();
+}
+
+static uint32_t dds_sd_data_blocks(uint32_t size)
+{
+	return DDS_SD_SPAN(size) / DDS_SD_BLOCK;
+}
+
+static bool dds_sd_entry_valid(const struct dds_sd_entry *entry)
+{
+	return entry->magic == DDS_SD_ENTRY_MAGIC && entry->generation == dds_sd_generation &&
+			entry->entry_crc == dds_sd_crc(entry, offsetof(struct dds_sd_entry, entry_crc));
+}
+
+/* rebuild index from log, read error leaves store unusable rather than truncating log */
+static bool dds_sd_scan(void)
+{
+	const struct dds_sd_entry *entry = (const struct dds_sd_entry *) dds_sd_block;
+	uint32_t block = DDS_SD_FIRST_BLOCK + 1;
+
+	memset(dds_sd_index, 0, sizeof(dds_sd_index));
+	dds_sd_seq = 0;
+
+	while (block < dds_sd_blocks) {
+		if (!dds_sd_read(dds_sd_block, block, 1)) {
+			dds_sd_generation = 0;
+			return false;
+		}
+
+		if (!dds_sd_entry_valid(entry) || entry->seq != dds_sd_seq)
+			break;
+
+		dds_sd_index[entry->id] = entry->size ? block : 0;
+		block += 1 + dds_sd_data_blocks(entry->size);
+		dds_sd_seq++;
+	}
+
+	dds_sd_next = block;
+
+	return true;
+}
+
+bool dds_sd_init(void)
+{
+	const struct dds_sd_head *head = (const struct dds_sd_head *) dds_sd_block;
+	SD_CardInfo info;
+
+	dds_sd_blocks = 0;
+	dds_sd_generation = 0;
+
+	dds_sd_nvic_init();
+
+	if (SD_Init() != SD_OK || SD_GetCardInfo(&info) != SD_OK)
+		return false;
+
+	if (info.CardType == SDIO_HIGH_CAPACITY_SD_CARD)
+		dds_sd_blocks = (info.SD_csd.DeviceSize + 1) * 1024;
+	else
+		dds_sd_blocks = info.CardCapacity / DDS_SD_BLOCK;
+
+	if (dds_sd_blocks > DDS_SD_MAX_BLOCKS)
+		dds_sd_blocks = DDS_SD_MAX_BLOCKS;
+
+	if (!dds_sd_read(dds_sd_block, DDS_SD_FIRST_BLOCK, 1))
+		return false;
+
+	/* foreign card is left alone until formatted */
+	if (head->magic != DDS_SD_HEAD_MAGIC || head->generation == 0)
+		return false;
+
+	dds_sd_generation = head->generation;
+
+	return dds_sd_scan();
+}
+
+dds_res dds_sd_format(void)
+{
+	struct dds_sd_head *head = (struct dds_sd_head *) dds_sd_block;
+	uint32_t generation = dds_sd_generation + 1;
+
+	if (dds_sd_blocks <= DDS_SD_FIRST_BLOCK + 1 || dds_sd_rec_next)
+		return DDS_ERR_SD;
+
+	if (generation == 0)
+		generation = 1;
+
+	memset(dds_sd_block, 0, sizeof(dds_sd_block));
+	head->magic = DDS_SD_HEAD_MAGIC;
+	head->generation = generation;
+
+	dds_sd_generation = 0;
+	if (!dds_sd_write(dds_sd_block, DDS_SD_FIRST_BLOCK, 1))
+		return DDS_ERR_SD;
+
+	dds_sd_generation = generation;
+	memset(dds_sd_index, 0, sizeof(dds_sd_index));
+	dds_sd_seq = 0;
+	dds_sd_next = DDS_SD_FIRST_BLOCK + 1;
+
+	return DDS_OK;
+}
+
+static dds_res dds_sd_append(uint8_t id, uint8_t flags, uint32_t size, uint32_t offset, uint32_t crc)
+{
+	struct dds_sd_entry *entry = (struct dds_sd_entry *) dds_sd_block;
+
+	memset(dds_sd_block, 0, sizeof(dds_sd_block));
+	entry->magic = DDS_SD_ENTRY_MAGIC;
+	entry->generation = dds_sd_generation;
+	entry->seq = dds_sd_seq;
+	entry->id = id;
+	entry->flags = flags;
+	entry->size = size;
+	entry->offset = offset;
+	entry->crc = crc;
+	entry->entry_crc = dds_sd_crc(entry, offsetof(struct dds_sd_entry, entry_crc));
+
+	if (!dds_sd_write(dds_sd_block, dds_sd_next, 1))
+		return DDS_ERR_SD;
+
+	dds_sd_index[id] = size ? dds_sd_next : 0;
+	dds_sd_next += 1 + dds_sd_data_blocks(size);
+	dds_sd_seq++;
+
+	return DDS_OK;
+}
+
+dds_res dds_sd_save(uint8_t id, const void *data, size_t size, uint32_t offset)
+{
+	uint32_t count = dds_sd_data_blocks(size);
+
+	if (!dds_sd_generation || dds_sd_rec_next || size == 0)
+		return DDS_ERR_SD;
+
+	if (dds_sd_next >= dds_sd_blocks || count > dds_sd_blocks - dds_sd_next - 1)
+		return DDS_ERR_MEM;
+
+	if (!dds_sd_write(data, dds_sd_next + 1, count))
+		return DDS_ERR_SD;
+
+	return dds_sd_append(id, 0, size, offset, dds_sd_crc(data, size));
+}
+
+dds_res dds_sd_load(uint8_t id, void *data, size_t max_size, size_t *size, uint32_t *offset)
+{
+	const struct dds_sd_entry *entry = (const struct dds_sd_entry *) dds_sd_block;
+	uint32_t block = dds_sd_index[id];
+	uint32_t crc;
+
+	if (!dds_sd_generation)
+		return DDS_ERR_SD;
+
+	if (!block)
+		return DDS_ERR_NOT_CACHED;
+
+	if (!dds_sd_read(dds_sd_block, block, 1) || !dds_sd_entry_valid(entry) || entry->id != id)
+		return DDS_ERR_SD;
+
+	if (entry->flags & DDS_SD_FLAG_STREAM)
+		return DDS_ERR_DATA;
+
+	if (DDS_SD_SPAN(entry->size) > max_size)
+		return DDS_ERR_MEM;
+
+	*size = entry->size;
+	*offset = entry->offset;
+	crc = entry->crc;
+
+	if (!dds_sd_read(data, block + 1, dds_sd_data_blocks(*size)))
+		return DDS_ERR_SD;
+
+	if (dds_sd_crc(data, *size) != crc)
+		return DDS_ERR_CHECKSUM;
+
+	return DDS_OK;
+}
+
+dds_res dds_sd_delete(uint8_t id)
+{
+	if (!dds_sd_generation || dds_sd_rec_next)
+		return DDS_ERR_SD;
+
+	if (!dds_sd_index[id])
+		return DDS_ERR_NOT_CACHED;
+
+	if (dds_sd_next >= dds_sd_blocks)
+		return DDS_ERR_MEM;
+
+	return dds_sd_append(id, 0, 0, 0, 0);
+}
+
+unsigned dds_sd_count(void)
+{
+	unsigned i, n = 0;
+
+	for (i = 0; i < DDS_SD_IDS; i++) {
+		if (dds_sd_index[i])
+			n++;
+	}
+
+	return n;
+}
+
+/* header goes to first data block, samples follow in whole blocks */
+dds_res dds_sd_record_begin(uint8_t id, const void *header, size_t size)
+{
+	if (!dds_sd_generation || dds_sd_rec_next || size > DDS_SD_BLOCK)
+		return DDS_ERR_SD;
+
+	if (dds_sd_next >= dds_sd_blocks || dds_sd_blocks - dds_sd_next < 3)
+		return DDS_ERR_MEM;
+
+	memset(dds_sd_block, 0, sizeof(dds_sd_block));
+	memcpy(dds_sd_block, header, size);
+
+	if (!dds_sd_write(dds_sd_block, dds_sd_next + 1, 1))
+		return DDS_ERR_SD;
+
+	dds_sd_rec_id = id;
+	dds_sd_rec_next = dds_sd_next + 2;
+
+	return DDS_OK;
+}
+
+dds_res dds_sd_record_write(const void *data, uint32_t count)
+{
+	if (!dds_sd_rec_next)
+		return DDS_ERR_SD;
+
+	if (count > dds_sd_blocks - dds_sd_rec_next) {
+		dds_sd_rec_next = 0;
+		return DDS_ERR_MEM;
+	}
+
+	if (!dds_sd_write(data, dds_sd_rec_next, count)) {
+		dds_sd_rec_next = 0;
+		return DDS_ERR_SD;
+	}
+
+	dds_sd_rec_next += count;
+
+	return DDS_OK;
+}
+
+/* size of samples written, the partial last block included */
+dds_res dds_sd_record_end(size_t size)
+{
+	uint32_t blocks = dds_sd_rec_next - dds_sd_next - 2;
+
+	if (!dds_sd_rec_next)
+		return DDS_ERR_SD;
+
+	dds_sd_rec_next = 0;
+
+	if (dds_sd_data_blocks(size) != blocks)
+		return DDS_ERR_DATA;
+
+	return dds_sd_append(dds_sd_rec_id, DDS_SD_FLAG_STREAM, DDS_SD_BLOCK + size, 0, 0);
+}
+
+/* blocks written so far are left out of the log */
+void dds_sd_record_abort(void)
+{
+	dds_sd_rec_next = 0;
+}
+
+/* header block is read into header, which must hold a whole block */
+dds_res dds_sd_stream_open(uint8_t id, void *header, size_t *size)
+{
+	const struct dds_sd_entry *entry = (const struct dds_sd_entry *) dds_sd_block;
+	uint32_t block = dds_sd_index[id];
+
+	if (!dds_sd_generation)
+		return DDS_ERR_SD;
+
+	if (!block)
+		return DDS_ERR_NOT_CACHED;
+
+	if (!dds_sd_read(dds_sd_block, block, 1) || !dds_sd_entry_valid(entry) || entry->id != id)
+		return DDS_ERR_SD;
+
+	if (!(entry->flags & DDS_SD_FLAG_STREAM) || entry->size < DDS_SD_BLOCK)
+		return DDS_ERR_DATA;
+
+	*size = entry->size - DDS_SD_BLOCK;
+	dds_sd_play_next = block + 2;
+	dds_sd_play_end = block + 1 + dds_sd_data_blocks(entry->size);
+
+	if (!dds_sd_read(header, block + 1, 1))
+		return DDS_ERR_SD;
+
+	return DDS_OK;
+}
+
+/* next count sample blocks of opened stream */
+dds_res dds_sd_stream_read(void *data, uint32_t count)
+{
+	if (count > dds_sd_play_end - dds_sd_play_next)
+		return DDS_ERR_DATA;
+
+	if (!dds_sd_read(data, dds_sd_play_next, count))
+		return DDS_ERR_SD;
+
+	dds_sd_play_next += count;
+
+	return DDS_OK;
+}
@@ -32,6 +32,7 @@
  *
  **/
 
+#include <stdio.h>
 #include <string.h>
 #include "stm32f4_discovery.h"
 
@@ -40,14 +41,44 @@
 #include "lwip/tcp.h"
 
 #include "dds.h"
+#include "dds_arena.h"
+#include "dds_crc.h"
+#include "dds_flash.h"
+#include "dds_ring.h"
+#include "dds_sd.h"
 #include "dds_server.h"
+#include "main.h"
+
+/* arena is split into this many DDS buffers, all but two hold cached or library waveforms,
+ * frame too big for one buffer takes over neighbouring ones, so the library keeps up to
+ * DDS_SERVER_SLOTS - 2 small presets or fewer large ones */
+#ifndef DDS_SERVER_SLOTS
+ #define DDS_SERVER_SLOTS		16
+#endif
+
+/* stream ring and SD card loads take up to this many free buffers */
+#define DDS_SERVER_WIDE_SLOTS	(DDS_SERVER_SLOTS / 2)
+
+#define DDS_SERVER_LIB_NONE		0xff
+
+#if DDS_SERVER_SLOTS < 2
+ #error "DDS_SERVER_SLOTS must be at least 2, one plays while the other receives"
+#endif
+
+/* SD stream keeps this much playing time in the ring, covers card read latency */
+#ifndef DDS_SERVER_SD_AHEAD_MS
+ #define DDS_SERVER_SD_AHEAD_MS	20
+#endif
 
 /* DDS server protocol states */
 enum tcp_echoserver_states
 {
 	DS_IDLE = 0,		/* idle, waiting for connection */
 	DS_HEADER,			/* waiting for frame header */
+	DS_HEADER_V2,		/* receiving v2 header and extensions */
 	DS_RECEIVING,		/* receiving data */
+	DS_STREAMING,		/* forwarding stream frame samples to DAC */
+	DS_CLOSING,			/* reply sent, ignoring data until connection closes */
 };
 
 /* DDS server state */
@@ -61,23 +92,94 @@ struct dds_server_struct
 	} dds;
 
 	size_t 				recv_size;  /* size of DDS data in buffer*/
-	size_t				max_size;	/* DDS buffer size */
+	size_t				max_size;	/* DDS buffer size, one slot */
+
+	/* next frame is received while another slot keeps playing */
+	unsigned char		*slot[DDS_SERVER_SLOTS];	/* DDS buffers */
+	u8_t				recv_slot;	/* slot dds.data points to */
+	u8_t				play_slot;	/* slot of last started frame, DDS_SERVER_SLOTS - none */
+	u8_t				swap_slot;	/* slot of frame swapped out, may play until period end, DDS_SERVER_SLOTS - none */
+	u8_t				swap_span;	/* slots of that frame */
+	dds_header			*play_header;	/* waveform frame in play slot, NULL - can't be saved */
+
+	/* waveform frames stay in their slot until it is reused, least recently played first */
+	dds_header			*cached[DDS_SERVER_SLOTS];	/* header of cached waveform, NULL - none */
+	u32_t				used[DDS_SERVER_SLOTS];		/* tick of last start */
+	u32_t				tick;
+
+	/* frame too big for one slot runs on into the slots above it, slot[i - 1] follows slot[i] */
+	u8_t				span[DDS_SERVER_SLOTS];		/* slots of frame based here, 0 - part of one below */
+
+	/* library waveforms are kept until deleted */
+	u8_t				lib_id[DDS_SERVER_SLOTS];	/* waveform ID, DDS_SERVER_LIB_NONE - evictable */
+	u8_t				lib_store;	/* ID of next waveform frame, DDS_SERVER_LIB_NONE - play it */
+
+	/* reply value of library command */
+	u8_t				value_type;	/* enum dds_server_value */
+	u32_t				value;
+
+	struct tcp_pcb		*pcb;		/* active connection */
+	bool				session;	/* persistent connection, binary replies */
+	bool				active;		/* data received since last poll */
+
+	/* DDS_FLAG_RATE frame */
+	uint32_t			rate_req[2];	/* requested sample rate in mHz */
+	uint32_t			rate[2];		/* achieved sample rate, 0 - not requested */
+
+	/* v2 frame header, rebuilt as dds_header once complete */
+	u8_t				version;	/* protocol version of current frame */
+	u16_t				detail;		/* enum dds_detail of failed frame */
+	union {
+		dds_header_v2	header;
+		u8_t			data[sizeof(dds_header_v2) + DDS_EXT_MAX_SIZE];
+	} v2;
+	size_t				v2_size;	/* received bytes of v2 header */
+	dds_header			v2_frame;	/* rebuilt header, moved to receive slot once nothing plays from it */
+
+	/* stream frame */
+	dds_header			*stream_header;	/* header in slot holding the ring */
+	struct pbuf			*pending;		/* received samples not yet in ring */
+	u16_t				pending_off;	/* consumed bytes of pending head */
+	u32_t				stream_left;	/* sample bytes left in frame, 0 - unbounded */
+	bool				stream_sized;	/* stream frame has known size */
+	bool				stream_started;	/* DAC is draining the ring */
+
+	/* stream frame recorded to SD card instead of playing */
+	bool				sd_record_next;	/* next stream frame is recorded */
+	u8_t				sd_record_id;
+	bool				recording;		/* ring is drained to SD card */
+	u32_t				sd_recorded;	/* sample bytes written */
+
+	/* stream played from SD card, samples are read into the ring ahead of DAC */
+	bool				sd_streaming;
+	bool				sd_started;		/* DAC is draining the ring */
+	u32_t				sd_left;		/* sample bytes still on card */
+	u32_t				sd_ahead;		/* bytes buffered before DAC starts */
+	u32_t				sd_chunk;		/* bytes per card read */
+};
+
+enum dds_server_value {
+	DDS_SERVER_VALUE_NONE = 0,
+	DDS_SERVER_VALUE_LIBRARY,		/* bitmap of library IDs */
+	DDS_SERVER_VALUE_SD_COUNT,		/* waveforms on SD card */
+	DDS_SERVER_VALUE_UNDERRUNS,		/* underruns of last stream */
 };
 
 static struct tcp_pcb *dds_server_pcb;
 static struct dds_server_struct dds_server_state;
 
+/* v2 payload is word aligned when dds_header is moved by this much */
+#define DDS_SERVER_V2_PAD		((4 - sizeof(struct dds_header_struct) % 4) % 4)
+
+/* stream frames use the DDS buffer past the header as sample ring */
+static struct dds_ring dds_stream_ring;
+
 /* LEDs */
 #define DDS_SERVER_LED_DATA_ERROR           (LED3)		/* orange */
 #define DDS_SERVER_LED_CONVERSION			(LED4)		/* green */
 #define DDS_SERVER_LED_PROTOCOL_ERROR   	(LED5)		/* red */
 #define DDS_SERVER_LED_ACTIVE_CONNECTION  	(LED6)		/* blue */
 
-static void dds_server_error(void *arg, err_t err)
-{
-	STM_EVAL_LEDOn(DDS_SERVER_LED_PROTOCOL_ERROR);
-}
-
 static void dds_server_connection_close(struct tcp_pcb *tpcb, struct dds_server_struct *dds_server)
 {
 	/* remove all callbacks */
@@ -90,6 +192,7 @@ static void dds_server_connection_close(struct tcp_pcb *tpcb, struct dds_server_
 	STM_EVAL_LEDOff(DDS_SERVER_LED_ACTIVE_CONNECTION);
 
 	dds_server->state = DS_IDLE;
+	dds_server->pcb = NULL;
 
 	/* close tcp connection */
 	tcp_close(tpcb);
@@ -107,26 +210,1188 @@ static err_t dds_server_sent(void *arg, struct tcp_pcb *tpcb, u16_t len)
 	return ERR_OK;
 }
 
-static void dds_server_send(struct tcp_pcb *tpcb, struct dds_server_struct *dds_server, enum dds_res res)
+/* slot holding start of frame that slot i belongs to */
+static u8_t dds_server_slot_base(struct dds_server_struct *dds_server, u8_t i)
+{
+	u8_t b;
+
+	for (b = i; b < DDS_SERVER_SLOTS; b++) {
+		if (dds_server->span[b])
+			break;
+	}
+
+	return b;
+}
+
+/* slot belongs to playing or library frame, it can't be received into */
+static bool dds_server_slot_busy(struct dds_server_struct *dds_server, u8_t i)
+{
+	u8_t b = dds_server_slot_base(dds_server, i);
+
+	return b == dds_server->play_slot || dds_server->lib_id[b] != DDS_SERVER_LIB_NONE;
+}
+
+/* bytes of frame based in slot i */
+static size_t dds_server_slot_size(struct dds_server_struct *dds_server, u8_t i)
+{
+	return dds_server->span[i] * dds_server->max_size;
+}
+
+/* largest frame free slots can take, reported with DDS_ERR_MEM */
+static size_t dds_server_frame_max(struct dds_server_struct *dds_server)
+{
+	u8_t i, run = 0, max = 0;
+
+	for (i = 0; i < DDS_SERVER_SLOTS; i++) {
+		run = dds_server_slot_busy(dds_server, i) ? 0 : run + 1;
+		if (run > max)
+			max = run;
+	}
+
+	return max * dds_server->max_size;
+}
+
+/* achieved sample rate error in parts per billion */
+static s32_t dds_server_rate_error(struct dds_server_struct *dds_server, int ch)
+{
+	if (!dds_server->rate[ch])
+		return 0;
+
+	return (s32_t) (((double) dds_server->rate[ch] - dds_server->rate_req[ch]) * 1e9 /
+			dds_server->rate_req[ch]);
+}
+
+/* queue frame result, text for single frame connections, dds_reply in sessions */
+static err_t dds_server_reply(struct tcp_pcb *tpcb, struct dds_server_struct *dds_server, enum dds_res res)
 {
 	err_t wr_err = ERR_OK;
+	int i;
 
-	const char *res_str = dds_res_to_str(res);
+	if (dds_server->version == DDS_PROTOCOL_VERSION) {
+		dds_reply_v2 reply;
+
+		memcpy(reply.magic, "MRR2", sizeof(reply.magic));
+		reply.version = DDS_PROTOCOL_VERSION;
+		reply.res = res;
+		reply.detail = dds_server->detail;
+		reply.value = (res == DDS_ERR_MEM) ? dds_server_frame_max(dds_server) : dds_server->value;
+		for (i = 0; i < 2; i++) {
+			reply.rate[i] = dds_server->rate[i];
+			reply.error[i] = dds_server_rate_error(dds_server, i);
+		}
+
+		wr_err = tcp_write(tpcb, &reply, sizeof(reply), 1);
+	} else if (dds_server->session) {
+		dds_reply reply;
+
+		memcpy(reply.magic, "MARR", sizeof(reply.magic));
+		reply.res = res;
+		reply.value = (res == DDS_ERR_MEM) ? dds_server_frame_max(dds_server) : dds_server->value;
+		for (i = 0; i < 2; i++) {
+			reply.rate[i] = dds_server->rate[i];
+			reply.error[i] = dds_server_rate_error(dds_server, i);
+		}
+
+		wr_err = tcp_write(tpcb, &reply, sizeof(reply), 1);
+	} else {
+		char res_str[128];
+		int res_len;
+
+		if (res == DDS_ERR_MEM)
+			/* let client know how big frame fits */
+			res_len = snprintf(res_str, sizeof(res_str), "%s (%u bytes available)",
+					dds_res_to_str(res), (unsigned) dds_server_frame_max(dds_server));
+		else if (dds_server->value_type == DDS_SERVER_VALUE_LIBRARY)
+			res_len = snprintf(res_str, sizeof(res_str), "%s (library 0x%08lx)",
+					dds_res_to_str(res), dds_server->value);
+		else if (dds_server->value_type == DDS_SERVER_VALUE_SD_COUNT)
+			res_len = snprintf(res_str, sizeof(res_str), "%s (%lu on SD card)",
+					dds_res_to_str(res), dds_server->value);
+		else if (dds_server->value_type == DDS_SERVER_VALUE_UNDERRUNS)
+			res_len = snprintf(res_str, sizeof(res_str), "%s (%lu underruns)",
+					dds_res_to_str(res), dds_server->value);
+		else
+			res_len = snprintf(res_str, sizeof(res_str), "%s", dds_res_to_str(res));
+
+		/* no float printf, rate in mHz and error in ppb printed as fixed point */
+		for (i = 0; i < 2; i++) {
+			s32_t err = dds_server_rate_error(dds_server, i);
+			u32_t abs_err = err < 0 ? -err : err;
+
+			if (!dds_server->rate[i])
+				continue;
+
+			res_len += snprintf(res_str + res_len, sizeof(res_str) - res_len,
+					", ch%d %u.%03u Hz (%c%u.%03u ppm)", i + 1,
+					(unsigned) (dds_server->rate[i] / 1000), (unsigned) (dds_server->rate[i] % 1000),
+					err < 0 ? '-' : '+', (unsigned) (abs_err / 1000), (unsigned) (abs_err % 1000));
+		}
+
+		wr_err = tcp_write(tpcb, res_str, res_len, 1);
+	}
 
-	tcp_sent(tpcb, dds_server_sent);
-	wr_err = tcp_write(tpcb, res_str, strlen(res_str), 1);
 	if (wr_err == ERR_OK)
 		tcp_output(tpcb);
-	else
+
+	return wr_err;
+}
+
+/* reply and close connection once reply is acknowledged */
+static void dds_server_send(struct tcp_pcb *tpcb, struct dds_server_struct *dds_server, enum dds_res res)
+{
+	tcp_sent(tpcb, dds_server_sent);
+	if (dds_server_reply(tpcb, dds_server, res) != ERR_OK)
 		dds_server_connection_close(tpcb, dds_server);
 }
 
+/* number of bytes to receive before next frame field can be checked */
+static size_t dds_server_frame_want(struct dds_server_struct *dds_server)
+{
+	if (dds_server->state == DS_HEADER_V2) {
+		if (dds_server->v2_size < sizeof(dds_header_v2))
+			return sizeof(dds_header_v2) - dds_server->v2_size;
+
+		return sizeof(dds_header_v2) + dds_server->v2.header.ext_size - dds_server->v2_size;
+	}
+
+	if (dds_server->recv_size < sizeof(dds_server->dds.header->magic))
+		return sizeof(dds_server->dds.header->magic) - dds_server->recv_size;
+
+	if (dds_server->recv_size < sizeof(struct dds_header_struct))
+		return sizeof(struct dds_header_struct) - dds_server->recv_size;
+
+	return dds_server->dds.header->size - dds_server->recv_size;
+}
+
+/* slot started playing, it can't be received into */
+static void dds_server_slot_played(struct dds_server_struct *dds_server, u8_t slot)
+{
+	/* ring of SD stream may become receive slot */
+	dds_server->sd_streaming = false;
+
+	/* previous frame keeps playing until period end if it was swapped out */
+	if (slot != dds_server->play_slot) {
+		dds_server->swap_slot = dds_server->play_slot;
+		if (dds_server->play_slot != DDS_SERVER_SLOTS)
+			dds_server->swap_span = dds_server->span[dds_server->play_slot];
+	}
+	dds_server->play_slot = slot;
+	dds_server->used[slot] = ++dds_server->tick;
+}
+
+/* frame based in slot b is evicted, each of its slots can be reused on its own */
+static void dds_server_slot_release(struct dds_server_struct *dds_server, u8_t b)
+{
+	u8_t i;
+
+	for (i = b + 1 - dds_server->span[b]; i <= b; i++) {
+		dds_server->span[i] = 1;
+		dds_server->cached[i] = NULL;
+		dds_server->used[i] = dds_server->used[b];
+	}
+}
+
+/* slots lo..hi are about to be written, finish swap still playing from any of them */
+static void dds_server_swap_guard(struct dds_server_struct *dds_server, u8_t lo, u8_t hi)
+{
+	u8_t b = dds_server->swap_slot;
+
+	if (b == DDS_SERVER_SLOTS || b < lo || b + 1 - dds_server->swap_span > hi)
+		return;
+
+	DDS_CompleteSwap();
+	dds_server->swap_slot = DDS_SERVER_SLOTS;
+}
+
+static void dds_server_swap_guard_recv(struct dds_server_struct *dds_server)
+{
+	u8_t r = dds_server->recv_slot;
+
+	dds_server_swap_guard(dds_server, r + 1 - dds_server->span[r], r);
+}
+
+/* receive next frame into least recently played slot, library ones are never evicted */
+static bool dds_server_pick_slot(struct dds_server_struct *dds_server)
+{
+	u8_t i, lru = DDS_SERVER_SLOTS;
+
+	for (i = 0; i < DDS_SERVER_SLOTS; i++) {
+		if (dds_server_slot_busy(dds_server, i))
+			continue;
+
+		if (lru == DDS_SERVER_SLOTS || dds_server->used[dds_server_slot_base(dds_server, i)] <
+				dds_server->used[dds_server_slot_base(dds_server, lru)])
+			lru = i;
+	}
+
+	if (lru == DDS_SERVER_SLOTS)
+		return false;
+
+	/* cached waveform is evicted by the next header */
+	dds_server_slot_release(dds_server, dds_server_slot_base(dds_server, lru));
+	dds_server->recv_slot = lru;
+	dds_server->dds.data = dds_server->slot[lru];
+
+	return true;
+}
+
+/*
+ * Frame of size bytes from start of receive slot doesn't fit it, take over
+ * the least recently played run of free slots instead. Header received so
+ * far moves along.
+ */
+static bool dds_server_grow_slot(struct dds_server_struct *dds_server, size_t size)
+{
+	size_t offset = dds_server->dds.data - dds_server->slot[dds_server->recv_slot];
+	u32_t n = (size + dds_server->max_size - 1) / dds_server->max_size;
+	u8_t i, j, base, best = DDS_SERVER_SLOTS;
+	u32_t best_used = 0;
+
+	if (n > DDS_SERVER_SLOTS)
+		return false;
+
+	for (j = 0; j + n <= DDS_SERVER_SLOTS; j++) {
+		u32_t run_used = 0;
+
+		for (i = j; i < j + n; i++) {
+			if (dds_server_slot_busy(dds_server, i))
+				break;
+			if (dds_server->used[dds_server_slot_base(dds_server, i)] > run_used)
+				run_used = dds_server->used[dds_server_slot_base(dds_server, i)];
+		}
+
+		if (i == j + n && (best == DDS_SERVER_SLOTS || run_used < best_used)) {
+			best = j;
+			best_used = run_used;
+		}
+	}
+
+	if (best == DDS_SERVER_SLOTS)
+		return false;
+
+	/* once the frame plays, next one needs a slot outside of it */
+	for (i = 0; i < DDS_SERVER_SLOTS; i++) {
+		if ((i < best || i >= best + n) && !dds_server_slot_busy(dds_server, i))
+			break;
+	}
+	if (i == DDS_SERVER_SLOTS && (dds_server->play_slot == DDS_SERVER_SLOTS ||
+			dds_server->lib_id[dds_server->play_slot] != DDS_SERVER_LIB_NONE))
+		return false;
+
+	for (i = best; i < best + n; i++)
+		dds_server_slot_release(dds_server, dds_server_slot_base(dds_server, i));
+	dds_server_swap_guard(dds_server, best, best + n - 1);
+
+	/* lowest slot of run holds the frame start */
+	base = best + n - 1;
+	memmove(dds_server->slot[base], dds_server->slot[dds_server->recv_slot],
+			offset + sizeof(struct dds_header_struct));
+	for (i = best; i < base; i++)
+		dds_server->span[i] = 0;
+	dds_server->span[base] = n;
+
+	dds_server->recv_slot = base;
+	dds_server->dds.data = dds_server->slot[base] + offset;
+
+	return true;
+}
+
+/* frame of unknown size is loaded, receive slot grows over as many free slots as it can, up to n */
+static void dds_server_grow_max(struct dds_server_struct *dds_server, u8_t n)
+{
+	for (; n > dds_server->span[dds_server->recv_slot]; n--) {
+		if (dds_server_grow_slot(dds_server, n * dds_server->max_size))
+			break;
+	}
+}
+
+/* frame in receive slot is playing now, receive next one into another */
+static void dds_server_next_slot(struct dds_server_struct *dds_server)
+{
+	dds_server_slot_played(dds_server, dds_server->recv_slot);
+	dds_server_pick_slot(dds_server);
+}
+
+/* wait for next frame header */
+static void dds_server_frame_reset(struct dds_server_struct *dds_server)
+{
+	dds_server->state = DS_HEADER;
+	dds_server->recv_size = 0;
+	dds_server->dds.data = dds_server->slot[dds_server->recv_slot];
+	dds_server->version = 1;
+	dds_server->detail = DDS_DETAIL_NONE;
+	dds_server->rate[0] = 0;
+	dds_server->rate[1] = 0;
+	dds_server->value_type = DDS_SERVER_VALUE_NONE;
+	dds_server->value = 0;
+}
+
+/* bytes of receive slot from dds.header on */
+static size_t dds_server_frame_space(struct dds_server_struct *dds_server)
+{
+	return dds_server_slot_size(dds_server, dds_server->recv_slot) -
+			(dds_server->dds.data - dds_server->slot[dds_server->recv_slot]);
+}
+
+/* walk v2 extensions, returns sample rates of DDS_TLV_RATE or NULL */
+static dds_res dds_server_v2_extensions(struct dds_server_struct *dds_server, const uint32_t **rate)
+{
+	size_t end = sizeof(dds_header_v2) + dds_server->v2.header.ext_size;
+	size_t off = sizeof(dds_header_v2);
+
+	*rate = NULL;
+
+	/* ext_size is multiple of 4, there is always room for next tlv header */
+	while (off < end) {
+		const dds_tlv *tlv = (const dds_tlv *) (dds_server->v2.data + off);
+		size_t len = (tlv->length + 3) & ~3;
+
+		off += sizeof(dds_tlv);
+		if (len > end - off) {
+			dds_server->detail = DDS_DETAIL_EXT_LENGTH;
+			return DDS_ERR_HEADER;
+		}
+
+		switch (tlv->type & ~DDS_TLV_CRITICAL) {
+		case DDS_TLV_RATE:
+			if (tlv->length != 2 * sizeof(uint32_t)) {
+				dds_server->detail = DDS_DETAIL_EXT_LENGTH;
+				return DDS_ERR_HEADER;
+			}
+			*rate = (const uint32_t *) (tlv + 1);
+			break;
+		default:
+			if (tlv->type & DDS_TLV_CRITICAL) {
+				dds_server->detail = DDS_DETAIL_EXT_UNKNOWN;
+				return DDS_ERR_HEADER;
+			}
+			break;
+		}
+
+		off += len;
+	}
+
+	return DDS_OK;
+}
+
+/* check v2 header as it arrives, rebuild it as dds_header in front of payload once complete */
+static dds_res dds_server_v2_header(struct dds_server_struct *dds_server)
+{
+	dds_header_v2 *v2 = &dds_server->v2.header;
+	size_t hdr_size = sizeof(dds_header_v2) + v2->ext_size;
+	const uint32_t *rate;
+	dds_header *header;
+	dds_res res;
+	int i;
+
+	if (dds_server->v2_size < sizeof(dds_header_v2))
+		return DDS_OK;
+
+	if (dds_server->v2_size == sizeof(dds_header_v2)) {
+		if (v2->version != DDS_PROTOCOL_VERSION) {
+			dds_server->detail = DDS_DETAIL_VERSION;
+			return DDS_ERR_HEADER;
+		}
+
+		if (v2->ext_size % 4 || v2->ext_size > DDS_EXT_MAX_SIZE) {
+			dds_server->detail = DDS_DETAIL_EXT_SIZE;
+			return DDS_ERR_HEADER;
+		}
+	}
+
+	if (dds_server->v2_size < hdr_size)
+		return DDS_OK;
+
+	res = dds_server_v2_extensions(dds_server, &rate);
+	if (res != DDS_OK)
+		return res;
+
+	if (v2->type > DDS_FRAME_TYPE_MASK) {
+		dds_server->detail = DDS_DETAIL_FRAME_TYPE;
+		return DDS_ERR_HEADER;
+	}
+
+	/* only streams may leave size open */
+	if ((v2->size == 0 && v2->type != DDS_FRAME_STREAM) || (v2->size && v2->size < hdr_size)) {
+		dds_server->detail = DDS_DETAIL_SIZE;
+		return DDS_ERR_HEADER;
+	}
+
+	dds_server->dds.data = dds_server->slot[dds_server->recv_slot] + DDS_SERVER_V2_PAD;
+	header = &dds_server->v2_frame;
+
+	memcpy(header->magic, "MARM", sizeof(header->magic));
+	header->checksum = v2->checksum;
+	header->size = v2->size ? v2->size - hdr_size + sizeof(struct dds_header_struct) : 0;
+	header->mode = DDS_MODE(v2->mode) | (v2->type << DDS_FRAME_TYPE_SHIFT) |
+			(v2->flags & DDS_FLAG_SESSION);
+	if (rate)
+		header->mode |= DDS_FLAG_RATE;
+
+	for (i = 0; i < 2; i++) {
+		header->ch[i].enabled     = v2->ch[i].enabled;
+		header->ch[i].data_format = v2->ch[i].data_format;
+		header->ch[i].data_offset = v2->ch[i].data_offset;
+		header->ch[i].data_size   = v2->ch[i].data_size;
+		header->ch[i].period      = rate ? rate[i] : v2->ch[i].period;
+		header->ch[i].prescaler   = v2->ch[i].prescaler;
+	}
+
+	dds_server->recv_size = sizeof(struct dds_header_struct);
+	dds_server->state = DS_RECEIVING;
+
+	return DDS_OK;
+}
+
+static void dds_server_stream_free(struct dds_server_struct *dds_server)
+{
+	if (dds_server->pending)
+		pbuf_free(dds_server->pending);
+
+	dds_server->pending = NULL;
+	dds_server->pending_off = 0;
+}
+
+/* recorded stream leaves the ring for SD card in whole blocks, straight from ring memory */
+static dds_res dds_server_record_drain(struct dds_server_struct *dds_server)
+{
+	const void *data;
+	size_t len;
+	dds_res res;
+
+	while ((len = dds_ring_read_span(&dds_stream_ring, &data)) >= DDS_SD_BLOCK) {
+		len &= ~(DDS_SD_BLOCK - 1);
+		res = dds_sd_record_write(data, len / DDS_SD_BLOCK);
+		if (res != DDS_OK)
+			return res;
+
+		dds_ring_consume(&dds_stream_ring, len);
+		dds_server->sd_recorded += len;
+	}
+
+	if (!dds_stream_ring.eof || dds_server->pending)
+		return DDS_OK;
+
+	/* connection lost before end of sized stream */
+	if (dds_server->stream_sized && dds_server->stream_left)
+		return DDS_ERR_TIMEOUT;
+
+	/* tail of last block is padded with whatever follows in the ring */
+	if (len) {
+		res = dds_sd_record_write(data, 1);
+		if (res != DDS_OK)
+			return res;
+
+		dds_ring_consume(&dds_stream_ring, len);
+		dds_server->sd_recorded += len;
+	}
+
+	dds_server->recording = false;
+
+	return dds_sd_record_end(dds_server->sd_recorded);
+}
+
+/* stream frame can't be played or recorded, drop the rest of it */
+static void dds_server_stream_fail(struct dds_server_struct *dds_server, dds_res res)
+{
+	STM_EVAL_LEDOn(DDS_SERVER_LED_DATA_ERROR);
+	if (dds_server->recording)
+		dds_sd_record_abort();
+	dds_server->recording = false;
+	dds_server_stream_free(dds_server);
+	dds_server->state = DS_CLOSING;
+	if (dds_server->pcb)
+		dds_server_send(dds_server->pcb, dds_server, res);
+	else
+		dds_server->state = DS_IDLE;
+}
+
+/* move as many pending samples to the ring as fit and open the TCP window by that much */
+static void dds_server_stream_pump(struct dds_server_struct *dds_server)
+{
+	u32_t consumed = 0;
+
+	while (dds_server->pending) {
+		struct pbuf *q = dds_server->pending;
+		u16_t len = q->len - dds_server->pending_off;
+		u16_t copied;
+
+		if (dds_server->stream_sized && len > dds_server->stream_left)
+			len = dds_server->stream_left;
+
+		copied = dds_ring_write(&dds_stream_ring,
+				(u8_t *) q->payload + dds_server->pending_off, len);
+		dds_server->pending_off += copied;
+		consumed += copied;
+		if (dds_server->stream_sized)
+			dds_server->stream_left -= copied;
+
+		if (copied < len)
+			break;
+
+		if (dds_server->stream_sized && dds_server->stream_left == 0) {
+			/* ignore anything past the end of frame */
+			consumed += q->tot_len - dds_server->pending_off;
+			dds_server_stream_free(dds_server);
+			break;
+		}
+
+		/* release head of chain */
+		dds_server->pending = q->next;
+		dds_server->pending_off = 0;
+		if (q->next)
+			pbuf_ref(q->next);
+		pbuf_free(q);
+	}
+
+	if (dds_server->pcb) {
+		while (consumed > 0) {
+			u16_t len = consumed > 0xffff ? 0xffff : consumed;
+			tcp_recved(dds_server->pcb, len);
+			consumed -= len;
+		}
+	}
+
+	if (!dds_server->pending &&
+			(!dds_server->pcb || (dds_server->stream_sized && dds_server->stream_left == 0)))
+		dds_stream_ring.eof = true;
+
+	if (!dds_server->stream_started && (dds_server->recording ||
+			dds_ring_used(&dds_stream_ring) >= 2 * DDS_STREAM_BLOCK_SIZE || dds_stream_ring.eof)) {
+		dds_res res;
+
+		STM_EVAL_LEDOff(DDS_SERVER_LED_CONVERSION);
+		if (dds_server->recording)
+			res = dds_sd_record_begin(dds_server->sd_record_id, dds_server->stream_header,
+					sizeof(struct dds_header_struct));
+		else
+			res = DDS_StartStream(dds_server->stream_header, &dds_stream_ring);
+		dds_server->stream_started = true;
+
+		if (res != DDS_OK) {
+			dds_server_stream_fail(dds_server, res);
+			return;
+		}
+	}
+
+	if (dds_server->recording) {
+		dds_res res = dds_server_record_drain(dds_server);
+
+		if (res != DDS_OK) {
+			dds_server_stream_fail(dds_server, res);
+			return;
+		}
+	}
+
+	/* connection already closed, nothing more will be received */
+	if (!dds_server->pcb && !dds_server->pending) {
+		dds_server->state = DS_IDLE;
+		return;
+	}
+
+	/* whole sized stream received */
+	if (dds_server->pcb && dds_ring_used(&dds_stream_ring) == 0 && dds_stream_ring.eof &&
+			dds_server->state == DS_STREAMING) {
+		dds_server->state = DS_CLOSING;
+		dds_server_send(dds_server->pcb, dds_server, DDS_OK);
+	}
+}
+
+static void dds_server_stream_begin(struct dds_server_struct *dds_server, struct pbuf *p, u16_t offset)
+{
+	dds_header *header;
+	u8_t *slot;
+	size_t ring_off, ring_size = 1;
+
+	/* ring may overwrite waveform still played until period end */
+	dds_server_grow_max(dds_server, DDS_SERVER_WIDE_SLOTS);
+	dds_server_swap_guard_recv(dds_server);
+
+	header = dds_server->dds.header;
+	slot = dds_server->slot[dds_server->recv_slot];
+
+	/* largest power of two that fits behind the header, from an SD block on */
+	ring_off = DDS_SD_SPAN(dds_server->dds.data - slot + sizeof(struct dds_header_struct));
+	while (ring_size * 2 <= dds_server_slot_size(dds_server, dds_server->recv_slot) - ring_off)
+		ring_size *= 2;
+
+	/* ring may still be drained by previous stream, recording keeps other output playing */
+	if (!dds_server->sd_record_next || DDS_StreamActive()) {
+		DDS_Stop();
+		STM_EVAL_LEDOff(DDS_SERVER_LED_CONVERSION);
+		dds_server->play_header = NULL;
+	}
+	dds_server->sd_streaming = false;
+
+	dds_ring_init(&dds_stream_ring, slot + ring_off, ring_size);
+
+	/* next frame must not land in the ring, unless it is only recorded */
+	dds_server->stream_header = header;
+	if (!dds_server->sd_record_next)
+		dds_server_next_slot(dds_server);
+
+	dds_server->recording = dds_server->sd_record_next;
+	dds_server->sd_record_next = false;
+	dds_server->sd_recorded = 0;
+
+	header->mode = DDS_MODE(header->mode);
+
+	dds_server->state = DS_STREAMING;
+	dds_server->stream_started = false;
+	dds_server->stream_sized = header->size != 0;
+	dds_server->stream_left = 0;
+	if (header->size > sizeof(struct dds_header_struct))
+		dds_server->stream_left = header->size - sizeof(struct dds_header_struct);
+
+	dds_server->pending = p;
+	dds_server->pending_off = offset;
+
+	dds_server_stream_pump(dds_server);
+}
+
+static dds_res dds_server_start_nco(dds_header *header)
+{
+	if (header->size != sizeof(struct dds_header_struct) + sizeof(dds_nco_config))
+		return DDS_ERR_HEADER;
+
+	return DDS_StartNco(header, (dds_nco_config *) header->data);
+}
+
+/* generate samples behind synth config and play them as waveform frame */
+static dds_res dds_server_start_synth(struct dds_server_struct *dds_server)
+{
+	dds_header *header = dds_server->dds.header;
+	dds_synth_config *synth = (dds_synth_config *) header->data;
+	dds_chconfig *chc = &header->ch[0];
+	size_t width, avail;
+	dds_res res;
+
+	if (header->size != sizeof(struct dds_header_struct) + sizeof(dds_synth_config))
+		return DDS_ERR_HEADER;
+
+	/* one channel only, dual mode would need interleaved samples */
+	header->mode = DDS_MODE(header->mode);
+	if (!chc->enabled || header->ch[1].enabled || header->mode == DDS_MODE_DUAL)
+		return DDS_ERR_CONFIG;
+
+	/* DMA needs samples aligned to transfer size */
+	chc->data_offset = sizeof(dds_synth_config) +
+			(-((u32_t) header->data + sizeof(dds_synth_config)) & 3);
+
+	width = (chc->data_format == DDS_FORMAT_8bit) ? 1 : 2;
+	avail = dds_server_frame_space(dds_server) - sizeof(struct dds_header_struct) - chc->data_offset;
+	if (synth->length > avail / width)
+		return DDS_ERR_MEM;
+
+	/* previous frame may still be played from receive slot until period end */
+	dds_server_swap_guard_recv(dds_server);
+
+	res = DDS_Synthesize(synth, chc->data_format, (u8_t *) header->data + chc->data_offset);
+	if (res != DDS_OK)
+		return res;
+
+	chc->data_size = synth->length;
+
+	/* generated samples are part of the frame now */
+	header->size = sizeof(struct dds_header_struct) + chc->data_offset + synth->length * width;
+
+	return DDS_Swap(header);
+}
+
+/* start waveform kept in slot n at sample clock of the request */
+static dds_res dds_server_replay(struct dds_server_struct *dds_server, int n)
+{
+	dds_header *query = dds_server->dds.header;
+	dds_header *header = dds_server->cached[n];
+	dds_res res;
+	int i;
+
+	/* samples and their layout stay as uploaded */
+	for (i = 0; i < 2; i++) {
+		if (!query->ch[i].enabled)
+			continue;
+
+		header->ch[i].period = query->ch[i].period;
+		header->ch[i].prescaler = query->ch[i].prescaler;
+	}
+
+	res = DDS_Swap(header);
+	if (res == DDS_OK) {
+		dds_server->play_header = header;
+		dds_server_slot_played(dds_server, n);
+	}
+
+	return res;
+}
+
+/* playing waveform frame is started from flash at boot */
+static dds_res dds_server_save(struct dds_server_struct *dds_server)
+{
+	u8_t *slot = dds_server->slot[dds_server->play_slot];
+	dds_header *header = dds_server->play_header;
+	u32_t offset;
+
+	if (!header)
+		return DDS_ERR_CONFIG;
+
+	/* v2 headers are moved in slot, keep payload alignment */
+	offset = (u8_t *) header - slot;
+	if (offset + header->size > dds_flash_capacity())
+		return DDS_ERR_MEM;
+
+	return dds_flash_save(slot, offset + header->size, offset) ? DDS_OK : DDS_ERR_FLASH;
+}
+
+/* playing waveform frame is kept on SD card, slot is written as a whole */
+static dds_res dds_server_sd_save(struct dds_server_struct *dds_server, u8_t id)
+{
+	u8_t *slot = dds_server->slot[dds_server->play_slot];
+	dds_header *header = dds_server->play_header;
+	u32_t offset;
+
+	if (!header)
+		return DDS_ERR_CONFIG;
+
+	offset = (u8_t *) header - slot;
+
+	return dds_sd_save(id, slot, offset + header->size, offset);
+}
+
+/* frame loaded into receive slot, header at offset, starts playing */
+static dds_res dds_server_start_loaded(struct dds_server_struct *dds_server, uint32_t offset)
+{
+	dds_res res;
+
+	dds_server->dds.data = dds_server->slot[dds_server->recv_slot] + offset;
+
+	res = DDS_Swap(dds_server->dds.header);
+	if (res == DDS_OK) {
+		if (dds_server->dds.header->checksum)
+			dds_server->cached[dds_server->recv_slot] = dds_server->dds.header;
+		dds_server->play_header = dds_server->dds.header;
+		dds_server_next_slot(dds_server);
+	} else {
+		dds_server->dds.data = dds_server->slot[dds_server->recv_slot];
+	}
+
+	return res;
+}
+
+/* waveform comes from SD card by SDIO DMA instead of network */
+static dds_res dds_server_sd_play(struct dds_server_struct *dds_server, u8_t id)
+{
+	size_t size;
+	uint32_t offset;
+	dds_res res;
+
+	dds_server_grow_max(dds_server, DDS_SERVER_WIDE_SLOTS);
+
+	res = dds_sd_load(id, dds_server->slot[dds_server->recv_slot],
+			dds_server_slot_size(dds_server, dds_server->recv_slot), &size, &offset);
+	if (res != DDS_OK)
+		return res;
+
+	if (offset + sizeof(struct dds_header_struct) > size)
+		return DDS_ERR_HEADER;
+
+	return dds_server_start_loaded(dds_server, offset);
+}
+
+/* checksum alone may collide, samples must also be laid out as the query says */
+static bool dds_server_cached_match(const dds_header *cached, const dds_header *query)
+{
+	int i;
+
+	if (cached->checksum != query->checksum || cached->mode != DDS_MODE(query->mode))
+		return false;
+
+	for (i = 0; i < 2; i++) {
+		if (cached->ch[i].enabled != query->ch[i].enabled)
+			return false;
+
+		if (cached->ch[i].enabled &&
+				(cached->ch[i].data_format != query->ch[i].data_format ||
+				 cached->ch[i].data_offset != query->ch[i].data_offset ||
+				 cached->ch[i].data_size != query->ch[i].data_size))
+			return false;
+	}
+
+	return true;
+}
+
+/* replay waveform cached under checksum of the header only frame at its sample clock */
+static dds_res dds_server_start_cached(struct dds_server_struct *dds_server)
+{
+	dds_header *query = dds_server->dds.header;
+	int n;
+
+	if (query->size != sizeof(struct dds_header_struct) || query->checksum == 0)
+		return DDS_ERR_HEADER;
+
+	for (n = 0; n < DDS_SERVER_SLOTS; n++) {
+		if (dds_server->cached[n] && dds_server_cached_match(dds_server->cached[n], query))
+			break;
+	}
+	if (n == DDS_SERVER_SLOTS)
+		return DDS_ERR_NOT_CACHED;
+
+	return dds_server_replay(dds_server, n);
+}
+
+/* waveform frame goes to library instead of playing */
+static dds_res dds_server_lib_store(struct dds_server_struct *dds_server, u8_t id)
+{
+	dds_header *header = dds_server->dds.header;
+	u8_t slot = dds_server->recv_slot;
+	int i, n = dds_server->span[slot];
+
+	for (i = 0; i < DDS_SERVER_SLOTS; i++) {
+		if (dds_server->lib_id[i] != DDS_SERVER_LIB_NONE && dds_server->lib_id[i] != id)
+			n += dds_server->span[i];
+	}
+
+	/* one slot plays, another one receives */
+	if (n > DDS_SERVER_SLOTS - 2)
+		return DDS_ERR_MEM;
+
+	dds_server->lib_id[slot] = id;
+	if (!dds_server_pick_slot(dds_server)) {
+		dds_server->lib_id[slot] = DDS_SERVER_LIB_NONE;
+		return DDS_ERR_MEM;
+	}
+	dds_server->cached[slot] = header;
+
+	/* older waveform with the same ID becomes evictable */
+	for (i = 0; i < DDS_SERVER_SLOTS; i++) {
+		if (i != slot && dds_server->lib_id[i] == id)
+			dds_server->lib_id[i] = DDS_SERVER_LIB_NONE;
+	}
+
+	return DDS_OK;
+}
+
+static int dds_server_lib_find(struct dds_server_struct *dds_server, u8_t id)
+{
+	int i;
+
+	for (i = 0; i < DDS_SERVER_SLOTS; i++) {
+		if (dds_server->lib_id[i] == id)
+			return i;
+	}
+
+	return -1;
+}
+
+/* keep SD stream ring topped up in whole chunks, DAC starts once read-ahead is buffered */
+static dds_res dds_server_sd_pump(struct dds_server_struct *dds_server)
+{
+	void *data;
+	size_t len, want;
+	dds_res res;
+
+	/* played to the end or replaced by another frame */
+	if (dds_server->sd_started && !DDS_StreamActive()) {
+		dds_server->sd_streaming = false;
+		return DDS_OK;
+	}
+
+	while (dds_server->sd_left) {
+		want = dds_server->sd_chunk;
+		if (want > DDS_SD_SPAN(dds_server->sd_left))
+			want = DDS_SD_SPAN(dds_server->sd_left);
+
+		if (dds_ring_space(&dds_stream_ring) < want)
+			break;
+
+		/* chunk isn't a divisor of ring size, read up to the wrap first */
+		len = dds_ring_write_span(&dds_stream_ring, &data);
+		if (len < want)
+			want = len & ~(DDS_SD_BLOCK - 1);
+		if (!want)
+			break;
+
+		res = dds_sd_stream_read(data, want / DDS_SD_BLOCK);
+		if (res != DDS_OK) {
+			/* play what is buffered and stop */
+			dds_server->sd_left = 0;
+			dds_stream_ring.eof = true;
+			return res;
+		}
+
+		if (want > dds_server->sd_left)
+			want = dds_server->sd_left;
+		dds_ring_produce(&dds_stream_ring, want);
+		dds_server->sd_left -= want;
+	}
+
+	if (!dds_server->sd_left)
+		dds_stream_ring.eof = true;
+
+	if (!dds_server->sd_started &&
+			(dds_ring_used(&dds_stream_ring) >= dds_server->sd_ahead || dds_stream_ring.eof)) {
+		res = DDS_StartStream(dds_server->stream_header, &dds_stream_ring);
+		dds_server->sd_started = true;
+
+		if (res != DDS_OK) {
+			dds_server->sd_streaming = false;
+			return res;
+		}
+	}
+
+	return DDS_OK;
+}
+
+/* stream recorded on SD card plays from a ring in receive slot, read-ahead follows its sample rate */
+static dds_res dds_server_sd_stream(struct dds_server_struct *dds_server, u8_t id)
+{
+	u8_t *slot;
+	dds_header *header;
+	size_t size, ring_size = 1;
+	u32_t rate;
+	dds_res res;
+
+	dds_server_grow_max(dds_server, DDS_SERVER_WIDE_SLOTS);
+
+	slot = dds_server->slot[dds_server->recv_slot];
+	header = (dds_header *) slot;
+
+	/* command frame in receive slot is overwritten */
+	res = dds_sd_stream_open(id, slot, &size);
+	if (res != DDS_OK)
+		return res;
+
+	rate = DDS_StreamByteRate(header);
+	if (!rate)
+		return DDS_ERR_CONFIG;
+
+	/* header keeps its block, ring takes the largest power of two behind it */
+	while (ring_size * 2 <= dds_server_slot_size(dds_server, dds_server->recv_slot) - DDS_SD_BLOCK)
+		ring_size *= 2;
+
+	/* ring may still be drained by previous stream */
+	DDS_Stop();
+	STM_EVAL_LEDOff(DDS_SERVER_LED_CONVERSION);
+
+	dds_ring_init(&dds_stream_ring, slot + DDS_SD_BLOCK, ring_size);
+
+	dds_server->stream_header = header;
+	dds_server->play_header = NULL;
+	dds_server_next_slot(dds_server);
+
+	/* chunks of half the read-ahead keep at least that much buffered while reading */
+	dds_server->sd_ahead = DDS_SD_SPAN((uint64_t) rate * DDS_SERVER_SD_AHEAD_MS / 1000);
+	if (dds_server->sd_ahead < 2 * DDS_SD_BLOCK)
+		dds_server->sd_ahead = 2 * DDS_SD_BLOCK;
+	if (dds_server->sd_ahead > ring_size)
+		dds_server->sd_ahead = ring_size;
+	dds_server->sd_chunk = (dds_server->sd_ahead / 2) & ~(DDS_SD_BLOCK - 1);
+
+	dds_server->sd_streaming = true;
+	dds_server->sd_started = false;
+	dds_server->sd_left = size;
+
+	return dds_server_sd_pump(dds_server);
+}
+
+/* library command, waveforms are played from their slot without copying */
+static dds_res dds_server_library(struct dds_server_struct *dds_server)
+{
+	const dds_library_cmd *cmd = (const dds_library_cmd *) dds_server->dds.header->data;
+	int i, n;
+
+	if (cmd->cmd <= DDS_LIB_CLEAR && cmd->cmd != DDS_LIB_LIST && cmd->id >= DDS_LIB_IDS)
+		return DDS_ERR_CONFIG;
+
+	switch (cmd->cmd) {
+	case DDS_LIB_STORE:
+		dds_server->lib_store = cmd->id;
+		return DDS_OK;
+	case DDS_LIB_PLAY:
+		n = dds_server_lib_find(dds_server, cmd->id);
+		if (n < 0)
+			return DDS_ERR_NOT_CACHED;
+		return dds_server_replay(dds_server, n);
+	case DDS_LIB_DELETE:
+		n = dds_server_lib_find(dds_server, cmd->id);
+		if (n < 0)
+			return DDS_ERR_NOT_CACHED;
+		dds_server->lib_id[n] = DDS_SERVER_LIB_NONE;
+		dds_server->cached[n] = NULL;
+		return DDS_OK;
+	case DDS_LIB_LIST:
+		for (i = 0; i < DDS_SERVER_SLOTS; i++) {
+			if (dds_server->lib_id[i] != DDS_SERVER_LIB_NONE)
+				dds_server->value |= 1UL << dds_server->lib_id[i];
+		}
+		dds_server->value_type = DDS_SERVER_VALUE_LIBRARY;
+		return DDS_OK;
+	case DDS_LIB_SAVE:
+		return dds_server_save(dds_server);
+	case DDS_LIB_CLEAR:
+		return dds_flash_erase() ? DDS_OK : DDS_ERR_FLASH;
+	case DDS_LIB_SD_SAVE:
+		return dds_server_sd_save(dds_server, cmd->id);
+	case DDS_LIB_SD_PLAY:
+		/* command frame in receive slot is overwritten */
+		return dds_server_sd_play(dds_server, cmd->id);
+	case DDS_LIB_SD_DELETE:
+		return dds_sd_delete(cmd->id);
+	case DDS_LIB_SD_COUNT:
+		dds_server->value = dds_sd_count();
+		dds_server->value_type = DDS_SERVER_VALUE_SD_COUNT;
+		return DDS_OK;
+	case DDS_LIB_SD_RECORD:
+		dds_server->sd_record_next = true;
+		dds_server->sd_record_id = cmd->id;
+		return DDS_OK;
+	case DDS_LIB_SD_STREAM:
+		return dds_server_sd_stream(dds_server, cmd->id);
+	case DDS_LIB_UNDERRUNS:
+		dds_server->value = DDS_StreamUnderruns();
+		dds_server->value_type = DDS_SERVER_VALUE_UNDERRUNS;
+		return DDS_OK;
+	case DDS_LIB_SD_FORMAT:
+		return dds_sd_format();
+	default:
+		return DDS_ERR_CONFIG;
+	}
+}
+
+/* playing waveform is saved and replayed at the rate it was retuned to */
+static void dds_server_retuned(struct dds_server_struct *dds_server, const dds_header *retune)
+{
+	dds_header *header = dds_server->play_header;
+	int i;
+
+	if (!header)
+		return;
+
+	for (i = 0; i < 2; i++) {
+		int ch = i;
+
+		if (!retune->ch[i].enabled)
+			continue;
+
+		/* first timer paces channel 2 alone when channel 1 is off in shared modes */
+		if (i == 0 && header->mode != DDS_MODE_INDEPENDENT && !header->ch[0].enabled)
+			ch = 1;
+
+		header->ch[ch].period = retune->ch[i].period;
+		header->ch[ch].prescaler = retune->ch[i].prescaler;
+	}
+}
+
+/* verify received frame and start it */
+static dds_res dds_server_start_frame(struct dds_server_struct *dds_server)
+{
+	dds_header *header = dds_server->dds.header;
+	dds_header *waveform = NULL;
+	u8_t lib_store = dds_server->lib_store;
+	dds_res res;
+
+	STM_EVAL_LEDOff(DDS_SERVER_LED_CONVERSION);
+
+	/* library store and SD record apply to the frame right after them */
+	dds_server->lib_store = DDS_SERVER_LIB_NONE;
+	dds_server->sd_record_next = false;
+
+	/* checksum of header only cached frame names the waveform, library commands have payload */
+	if ((DDS_FRAME_TYPE(header->mode) != DDS_FRAME_CACHED || header->size > sizeof(struct dds_header_struct)) &&
+			!dds_verify_checksum(header, dds_crc_final()))
+		return DDS_ERR_CHECKSUM;
+
+	switch (DDS_FRAME_TYPE(header->mode)) {
+	case DDS_FRAME_WAVEFORM:
+		header->mode = DDS_MODE(header->mode);
+		if (lib_store != DDS_SERVER_LIB_NONE)
+			return dds_server_lib_store(dds_server, lib_store);
+
+		res = DDS_Swap(header);
+		waveform = header;
+
+		/* zero checksum is not computed, frame can't be looked up */
+		if (res == DDS_OK && header->checksum)
+			dds_server->cached[dds_server->recv_slot] = header;
+		break;
+	case DDS_FRAME_NCO:
+		/* plays from LUT, slot stays free */
+		res = dds_server_start_nco(header);
+		if (res == DDS_OK)
+			dds_server->play_header = NULL;
+		return res;
+	case DDS_FRAME_SYNTH:
+		res = dds_server_start_synth(dds_server);
+		break;
+	case DDS_FRAME_SEQUENCE:
+		res = DDS_StartSequence(header);
+		break;
+	case DDS_FRAME_SWEEP:
+		res = DDS_StartSweep(header);
+		break;
+	case DDS_FRAME_RETUNE:
+		/* output keeps playing from the other slot */
+		res = DDS_Retune(header);
+		if (res == DDS_OK)
+			dds_server_retuned(dds_server, header);
+		return res;
+	case DDS_FRAME_CACHED:
+		/* receive slot stays free, cached one is playing */
+		if (header->size == sizeof(struct dds_header_struct) + sizeof(dds_library_cmd))
+			return dds_server_library(dds_server);
+		return dds_server_start_cached(dds_server);
+	default:
+		dds_server->detail = DDS_DETAIL_FRAME_TYPE;
+		return DDS_ERR_HEADER;
+	}
+
+	if (res == DDS_OK) {
+		dds_server->play_header = waveform;
+		dds_server_next_slot(dds_server);
+	}
+
+	return res;
+}
+
+static void dds_server_error(void *arg, err_t err)
+{
+	struct dds_server_struct *dds_server = arg;
+
+	STM_EVAL_LEDOn(DDS_SERVER_LED_PROTOCOL_ERROR);
+
+	if (!dds_server)
+		return;
+
+	/* pcb is already freed by lwIP */
+	dds_server->pcb = NULL;
+	if (dds_server->state != DS_STREAMING) {
+		dds_server->state = DS_IDLE;
+		return;
+	}
+
+	/* samples not in ring yet are lost, play the rest and let DAC stop at eof */
+	dds_server_stream_free(dds_server);
+	dds_server_stream_pump(dds_server);
+}
+
 static err_t dds_server_poll(void *arg, struct tcp_pcb *tpcb)
 {
 	LWIP_ASSERT("arg != NULL", arg != NULL);
 
 	struct dds_server_struct *dds_server = arg;
 
+	/* stream frames may last as long as the host keeps sending */
+	if (dds_server->state == DS_STREAMING) {
+		dds_server_stream_pump(dds_server);
+		return ERR_OK;
+	}
+
+	/* sessions stay open as long as client keeps sending */
+	if (dds_server->active) {
+		dds_server->active = false;
+		return ERR_OK;
+	}
+
+	dds_server->state = DS_CLOSING;
 	dds_server_send(tpcb, dds_server, DDS_ERR_TIMEOUT);
 
 	return ERR_OK;
@@ -140,6 +1405,13 @@ static err_t dds_server_recv(void *arg, struct tcp_pcb *tpcb, struct pbuf *p, er
 
 	if (p == NULL) {
 		/* remote host closed connection */
+		if (dds_server->state == DS_STREAMING) {
+			/* keep playing what was already received */
+			dds_server_connection_close(tpcb, dds_server);
+			dds_server->state = DS_STREAMING;
+			dds_server_stream_pump(dds_server);
+			return ERR_OK;
+		}
 		dds_server_connection_close(tpcb, dds_server);
 		return ERR_OK;
 	}
@@ -153,35 +1425,191 @@ static err_t dds_server_recv(void *arg, struct tcp_pcb *tpcb, struct pbuf *p, er
 		return err;
 	}
 
-	if (dds_server->state == DS_HEADER) {
-		if (!dds_verify_header(p->payload)) {
-			dds_server_send(tpcb, dds_server, DDS_ERR_HEADER);
-			return ERR_OK;
+	dds_server->active = true;
+
+	if (dds_server->state == DS_STREAMING) {
+		if (dds_server->pending)
+			pbuf_cat(dds_server->pending, p);
+		else {
+			dds_server->pending = p;
+			dds_server->pending_off = 0;
 		}
-		dds_server->state = DS_RECEIVING;
+		dds_server_stream_pump(dds_server);
+		return ERR_OK;
 	}
 
-	size_t copy_len = p->len;
-	if (dds_server->recv_size + copy_len > dds_server->max_size) {
-		/* no enough memory */
-		dds_server_send(tpcb, dds_server, DDS_ERR_MEM);
-		STM_EVAL_LEDOn(DDS_SERVER_LED_PROTOCOL_ERROR);
+	/* walk whole pbuf chain, frame fields may be split between segments */
+	struct pbuf *q = p;
+	u16_t off = 0;
+	u16_t consumed = 0;
+	bool close = false;
+	bool stream = false;
+	dds_res res = DDS_OK;
 
-		return ERR_OK;
+	while (q && dds_server->state != DS_CLOSING) {
+		if (off == q->len) {
+			q = q->next;
+			off = 0;
+			continue;
+		}
+
+		u16_t len = q->len - off;
+		size_t want = dds_server_frame_want(dds_server);
+		if (len > want)
+			len = want;
+
+		if (dds_server->state == DS_HEADER_V2) {
+			MEMCPY(dds_server->v2.data + dds_server->v2_size, (u8_t *) q->payload + off, len);
+			dds_server->v2_size += len;
+			off += len;
+			consumed += len;
+
+			res = dds_server_v2_header(dds_server);
+			if (res != DDS_OK) {
+				close = true;
+				break;
+			}
+
+			/* rebuilt header continues as v1 frame */
+			if (dds_server->state == DS_HEADER_V2)
+				continue;
+		} else {
+			MEMCPY(dds_server->dds.data + dds_server->recv_size, (u8_t *) q->payload + off, len);
+
+			/* checksum covers samples only, computed as they arrive */
+			if (dds_server->recv_size >= sizeof(struct dds_header_struct))
+				dds_crc_update((u8_t *) q->payload + off, len);
+
+			dds_server->recv_size += len;
+			off += len;
+			consumed += len;
+		}
+
+		if (dds_server->state == DS_HEADER) {
+			if (dds_server->recv_size < sizeof(dds_server->dds.header->magic))
+				continue;
+
+			if (dds_verify_header_v2((dds_header_v2 *) dds_server->dds.data)) {
+				/* v2 header has its own buffer, payload goes to slot */
+				MEMCPY(dds_server->v2.data, dds_server->dds.data, dds_server->recv_size);
+				dds_server->v2_size = dds_server->recv_size;
+				dds_server->version = DDS_PROTOCOL_VERSION;
+				dds_server->state = DS_HEADER_V2;
+				continue;
+			}
+
+			if (!dds_verify_header(dds_server->dds.header)) {
+				dds_server->detail = DDS_DETAIL_MAGIC;
+				res = DDS_ERR_HEADER;
+				close = true;
+				break;
+			}
+			dds_server->state = DS_RECEIVING;
+		}
+
+		if (dds_server->recv_size < sizeof(struct dds_header_struct))
+			continue;
+
+		/* header just completed */
+		if (dds_server->recv_size == sizeof(struct dds_header_struct)) {
+			bool v2 = dds_server->version == DDS_PROTOCOL_VERSION;
+			dds_header *header = v2 ? &dds_server->v2_frame : dds_server->dds.header;
+
+			if (header->mode & DDS_FLAG_SESSION)
+				dds_server->session = true;
+
+			/* timer settings are needed before any frame type starts */
+			if (header->mode & DDS_FLAG_RATE) {
+				dds_server->rate_req[0] = header->ch[0].period;
+				dds_server->rate_req[1] = header->ch[1].period;
+
+				res = DDS_SolveRates(header, dds_server->rate);
+				if (res != DDS_OK) {
+					dds_server->detail = DDS_DETAIL_RATE;
+					close = true;
+					break;
+				}
+			}
+
+			if (DDS_FRAME_TYPE(header->mode) == DDS_FRAME_STREAM) {
+				/* samples go to the ring, not to buffer */
+				if (v2) {
+					dds_server_swap_guard_recv(dds_server);
+					memcpy(dds_server->dds.header, header, sizeof(struct dds_header_struct));
+				}
+				stream = true;
+				break;
+			}
+
+			/* rest of frame can't be skipped reliably, give up on connection */
+			if (header->size < sizeof(struct dds_header_struct)) {
+				dds_server->detail = DDS_DETAIL_SIZE;
+				res = DDS_ERR_HEADER;
+				close = true;
+				break;
+			}
+
+			if (header->size > dds_server_frame_space(dds_server) &&
+					!dds_server_grow_slot(dds_server, dds_server->dds.data -
+							dds_server->slot[dds_server->recv_slot] + header->size)) {
+				/* no enough memory */
+				STM_EVAL_LEDOn(DDS_SERVER_LED_PROTOCOL_ERROR);
+				res = DDS_ERR_MEM;
+				close = true;
+				break;
+			}
+
+			/* payload and rebuilt v2 header must not land under waveform swapped out, v1 header only replaces its header */
+			if (v2 || header->size > sizeof(struct dds_header_struct))
+				dds_server_swap_guard_recv(dds_server);
+			if (v2)
+				memcpy(dds_server->dds.header, header, sizeof(struct dds_header_struct));
+
+			dds_crc_reset();
+		}
+
+		/* check if received whole frame */
+		if (dds_server->recv_size == dds_server->dds.header->size) {
+			res = dds_server_start_frame(dds_server);
+			if (res != DDS_OK)
+				STM_EVAL_LEDOn(DDS_SERVER_LED_DATA_ERROR);
+
+			if (!dds_server->session) {
+				close = true;
+				break;
+			}
+
+			/* wait for next frame, it may follow in the same segment */
+			if (dds_server_reply(tpcb, dds_server, res) != ERR_OK) {
+				close = true;
+				break;
+			}
+			dds_server_frame_reset(dds_server);
+		}
 	}
 
-	MEMCPY(dds_server->dds.data + dds_server->recv_size, p->payload, copy_len);
-	dds_server->recv_size += copy_len;
-	tcp_recved(tpcb, p->len);
+	if (stream) {
+		tcp_recved(tpcb, consumed);
 
-	/* check if received whole data */
-	if ((dds_server->recv_size >= sizeof(struct dds_header_struct)) &&
-			(dds_server->dds.header->size <= dds_server->recv_size)) {
-		STM_EVAL_LEDOff(DDS_SERVER_LED_CONVERSION);
-		dds_res res = DDS_Start(dds_server->dds.header);
-		if (res != DDS_OK)
-			STM_EVAL_LEDOn(DDS_SERVER_LED_DATA_ERROR);
+		/* hand the rest of chain over to stream, drop consumed pbufs */
+		if (off == q->len) {
+			q = q->next;
+			off = 0;
+		}
+		if (q)
+			pbuf_ref(q);
+		pbuf_free(p);
+
+		dds_server_stream_begin(dds_server, q, off);
+		return ERR_OK;
+	}
 
+	/* anything past the last frame is dropped */
+	tcp_recved(tpcb, p->tot_len);
+	pbuf_free(p);
+
+	if (close) {
+		dds_server->state = DS_CLOSING;
 		dds_server_send(tpcb, dds_server, res);
 	}
 
@@ -204,11 +1632,17 @@ static err_t dds_server_accept(void *arg, struct tcp_pcb *newpcb, err_t err)
 	STM_EVAL_LEDOff(DDS_SERVER_LED_PROTOCOL_ERROR);
 	STM_EVAL_LEDOff(DDS_SERVER_LED_DATA_ERROR);
 
-	DDS_Stop();
-	STM_EVAL_LEDOff(DDS_SERVER_LED_CONVERSION);
+	/* output keeps playing until a frame replaces it */
 
-	dds_server->state = DS_HEADER;
-	dds_server->recv_size = 0;
+	/* drop samples left over from previous stream */
+	dds_server_stream_free(dds_server);
+
+	dds_server_frame_reset(dds_server);
+	dds_server->pcb = newpcb;
+	dds_server->session = false;
+	dds_server->active = false;
+	dds_server->lib_store = DDS_SERVER_LIB_NONE;
+	dds_server->sd_record_next = false;
 
 	tcp_setprio(newpcb, TCP_PRIO_MIN);
 
@@ -231,29 +1665,88 @@ static void dds_server_dds_error_led()
 	STM_EVAL_LEDOn(DDS_SERVER_LED_DATA_ERROR);
 }
 
-void dds_server_init(void)
+/* DAC took a block out of the ring, refill it without waiting for next tick */
+static void dds_server_stream_drained()
+{
+	Deferred_Request();
+}
+
+/* buffers and DDS, everything but network */
+static bool dds_server_setup(void)
 {
 	dds dds_init;
-	dds_server_state.max_size = 1024;
+	int i;
 
-	/* allocate DDS data buffer */
-	dds_server_state.dds.data = mem_malloc(dds_server_state.max_size);
-	if (!dds_server_state.dds.data) {
-		printf("Can not allocate memory for DDS data\n");
-		return;
+	if (dds_server_state.max_size)
+		return dds_server_state.slot[DDS_SERVER_SLOTS - 1] != NULL;
+
+	/* waveform arena is split into DDS data buffers of whole SD blocks, aligned for SDIO DMA */
+	dds_arena_init();
+	dds_server_state.max_size = (dds_arena_capacity() / DDS_SERVER_SLOTS) & ~(DDS_SD_BLOCK - 1);
+
+	for (i = 0; i < DDS_SERVER_SLOTS; i++) {
+		dds_server_state.slot[i] = dds_arena_alloc(dds_server_state.max_size);
+		if (!dds_server_state.slot[i]) {
+			printf("Can not allocate memory for DDS data\n");
+			return false;
+		}
 	}
 
+	for (i = 0; i < DDS_SERVER_SLOTS; i++) {
+		dds_server_state.lib_id[i] = DDS_SERVER_LIB_NONE;
+		dds_server_state.span[i] = 1;
+	}
+
+	dds_server_state.recv_slot = 0;
+	dds_server_state.play_slot = DDS_SERVER_SLOTS;
+	dds_server_state.swap_slot = DDS_SERVER_SLOTS;
+	dds_server_state.dds.data = dds_server_state.slot[0];
+
 	/* initialize LEDs*/
 	STM_EVAL_LEDInit(DDS_SERVER_LED_DATA_ERROR);
 	STM_EVAL_LEDInit(DDS_SERVER_LED_CONVERSION);
 	STM_EVAL_LEDInit(DDS_SERVER_LED_PROTOCOL_ERROR);
 	STM_EVAL_LEDInit(DDS_SERVER_LED_ACTIVE_CONNECTION);
 
+	dds_crc_init();
+
 	/* initialize DDS functionality */
 	dds_init.dds_sync = dds_server_toggle_conversion_led;
 	dds_init.dds_err  = dds_server_dds_error_led;
+	dds_init.dds_drain = dds_server_stream_drained;
 	DDS_Init(dds_init);
 
+	return true;
+}
+
+/* start waveform saved in flash, called before network is up */
+void dds_server_restore(void)
+{
+	struct dds_server_struct *dds_server = &dds_server_state;
+	const void *data;
+	size_t size;
+	uint32_t offset;
+
+	if (!dds_server_setup())
+		return;
+
+	data = dds_flash_load(&size, &offset);
+	if (!data || (size > dds_server_frame_space(dds_server) && !dds_server_grow_slot(dds_server, size)))
+		return;
+
+	MEMCPY(dds_server->dds.data, data, size);
+	dds_server_start_loaded(dds_server, offset);
+}
+
+void dds_server_init(void)
+{
+	if (!dds_server_setup())
+		return;
+
+	/* card identification and log scan take long, flash waveform is already playing */
+	if (!dds_sd_init())
+		printf("No waveform store on SD card\n");
+
 	/* create new tcp pcb */
 	dds_server_pcb = tcp_new();
 
@@ -280,3 +1773,12 @@ void dds_server_init(void)
     /* initialize LwIP tcp_accept callback function */
     tcp_accept(dds_server_pcb, dds_server_accept);
 }
+
+void dds_server_process(void)
+{
+	if (dds_server_state.state == DS_STREAMING)
+		dds_server_stream_pump(&dds_server_state);
+
+	if (dds_server_state.sd_streaming && dds_server_sd_pump(&dds_server_state) != DDS_OK)
+		STM_EVAL_LEDOn(DDS_SERVER_LED_DATA_ERROR);
+}
@@ -42,6 +42,7 @@
 /* Includes ------------------------------------------------------------------*/
 #include "stm32f4x7_eth.h"
 #include "netconf.h"
+#include "ethernetif.h"
 #include "main.h"
 #include "dds_server.h"
 #include "serial_debug.h"
@@ -61,6 +62,7 @@
 /* Private variables ---------------------------------------------------------*/
 __IO uint32_t LocalTime = 0; /* this variable is used to create a time reference incremented by 10ms */
 uint32_t timingdelay;
+__IO uint8_t DeferredReady = 0; /* lwIP and dds server are up, PendSV may run them */
 
 /* Private function prototypes -----------------------------------------------*/
 void LCD_LED_Init(void);
@@ -81,9 +83,16 @@ int main(void)
        system_stm32f4xx.c file
      */
 
+  /* NVIC priorities are preemption levels, PendSV runs below every interrupt */
+  NVIC_PriorityGroupConfig(NVIC_PriorityGroup_4);
+  NVIC_SetPriority(PendSV_IRQn, 0x0F);
+
   /*Initialize LCD and Leds */ 
   LCD_LED_Init();
   
+  /* play waveform saved in flash while network comes up */
+  dds_server_restore();
+
   /* configure ethernet (GPIOs, clocks, MAC, DMA) */ 
   ETH_BSP_Config();
     
@@ -92,20 +101,54 @@ int main(void)
   
   /* dds server Init */
   dds_server_init();
+
+  /* frames received meanwhile wait in their descriptors */
+  DeferredReady = 1;
+  Deferred_Request();
    
-  /* Infinite loop */
+  /* Infinite loop, ETH, SysTick and DAC stream interrupts defer their work to PendSV */
   while (1)
   {  
-    /* check if any packet received */
-    if (ETH_CheckFrameReceived()) { 
-      /* process received ethernet packet */
-      LwIP_Pkt_Handle();
-    }
-    /* handle periodic timers for LwIP */
-    LwIP_Periodic_Handle(LocalTime);
+    __WFI();
   }   
 }
 
+/**
+  * @brief  Asks for Deferred_Handle() to run once no other interrupt is active.
+  * @param  None
+  * @retval None
+  */
+void Deferred_Request(void)
+{
+  SCB->ICSR = SCB_ICSR_PENDSVSET_Msk;
+}
+
+/**
+  * @brief  Network and DDS server work, called from PendSV only so lwIP
+  *         is never reentered.
+  * @param  None
+  * @retval None
+  */
+void Deferred_Handle(void)
+{
+  if (!DeferredReady)
+    return;
+
+  /* hand a batch of received packets to lwIP */
+  if (ETH_CheckFrameReceived()) { 
+    LwIP_Pkt_Handle();
+  }
+  /* handle periodic timers for LwIP */
+  LwIP_Periodic_Handle(LocalTime);
+  /* feed stream frame samples to DAC */
+  dds_server_process();
+
+  /* more packets than one batch, come back after timers and stream had a turn */
+  if (ethernetif_input_pending()) {
+    Deferred_Request();
+  }
+}
+
 /**
   * @brief  Inserts a delay time.
   * @param  nCount: number of 10ms periods to wait for.
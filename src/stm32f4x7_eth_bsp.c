@@ -55,6 +55,7 @@ __IO uint8_t EthLinkStatus = 0;
 /* Private function prototypes -----------------------------------------------*/
 static void ETH_GPIO_Config(void);
 static void ETH_MACDMA_Config(void);
+static void ETH_NVIC_Config(void);
 
 /* Private functions ---------------------------------------------------------*/
 
@@ -73,6 +74,9 @@ void ETH_BSP_Config(void)
   /* Configure the Ethernet MAC/DMA */
   ETH_MACDMA_Config();
 
+  /* Enable the Ethernet global interrupt */
+  ETH_NVIC_Config();
+
   if (EthInitStatus == 0)
   {
     LCD_SetTextColor(LCD_COLOR_RED);
@@ -154,6 +158,26 @@ static void ETH_MACDMA_Config(void)
 
   /* Configure Ethernet */
   EthInitStatus = ETH_Init(&ETH_InitStructure, LAN8720_PHY_ADDRESS);
+
+  /* Enable the Ethernet Rx Interrupt */
+  ETH_DMAITConfig(ETH_DMA_IT_NIS | ETH_DMA_IT_R, ENABLE);
+}
+
+/**
+  * @brief  Configures and enables the Ethernet global interrupt, below DAC
+  *         DMA and SDIO so received frames never delay samples.
+  * @param  None
+  * @retval None
+  */
+static void ETH_NVIC_Config(void)
+{
+  NVIC_InitTypeDef   NVIC_InitStructure;
+
+  NVIC_InitStructure.NVIC_IRQChannel = ETH_IRQn;
+  NVIC_InitStructure.NVIC_IRQChannelPreemptionPriority = 2;
+  NVIC_InitStructure.NVIC_IRQChannelSubPriority = 0;
+  NVIC_InitStructure.NVIC_IRQChannelCmd = ENABLE;
+  NVIC_Init(&NVIC_InitStructure);
 }
 
 /**
@@ -47,6 +47,7 @@
 /* Includes ------------------------------------------------------------------*/
 #include "stm32f4xx_it.h"
 #include "main.h"
+#include "stm32f4x7_eth.h"
 
 /* Private typedef -----------------------------------------------------------*/
 /* Private define ------------------------------------------------------------*/
@@ -145,6 +146,7 @@ void DebugMon_Handler(void)
   */
 void PendSV_Handler(void)
 {
+  Deferred_Handle();
 }
 
 /**
@@ -156,6 +158,9 @@ void SysTick_Handler(void)
 {
   /* Update the LocalTime by adding SYSTEMTICK_PERIOD_MS each SysTick interrupt */
   Time_Update();
+
+  /* lwIP timers run in PendSV */
+  Deferred_Request();
 }
 
 /******************************************************************************/
@@ -174,5 +179,22 @@ void SysTick_Handler(void)
 {
 }*/
 
+/**
+  * @brief  This function handles ethernet DMA interrupt request.
+  * @param  None
+  * @retval None
+  */
+void ETH_IRQHandler(void)
+{
+  /* frame received, descriptors are drained in PendSV */
+  if (ETH_GetDMAFlagStatus(ETH_DMA_FLAG_R) == SET)
+  {
+    ETH_DMAClearITPendingBit(ETH_DMA_IT_R);
+    Deferred_Request();
+  }
+
+  ETH_DMAClearITPendingBit(ETH_DMA_IT_NIS);
+}
+
 
 /*********** Portions COPYRIGHT 2012 Embest Tech. Co., Ltd.*****END OF FILE****/
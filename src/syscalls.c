@@ -114,6 +114,7 @@ int _write(int file, char *ptr, int len)
 caddr_t _sbrk(int incr)
 {
 	extern char end asm("end");
+	extern char _sdds_arena[];
 	static char *heap_end;
 	char *prev_heap_end;
 
@@ -121,7 +122,8 @@ caddr_t _sbrk(int incr)
 		heap_end = &end;
 
 	prev_heap_end = heap_end;
-	if (heap_end + incr > stack_ptr)
+	/* heap ends where DDS arena starts, stack lives in CCM RAM */
+	if (heap_end + incr > _sdds_arena)
 	{
 //		write(1, "Heap and stack collision\n", 25);
 //		abort();
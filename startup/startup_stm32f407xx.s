@@ -107,6 +107,18 @@ LoopFillZerobss:
   cmp  r2, r3
   bcc  FillZerobss
 
+/* Zero fill the CCM RAM bss segment. */
+  ldr  r2, =_sccmbss
+  b  LoopFillZeroCcmbss
+FillZeroCcmbss:
+  movs  r3, #0
+  str  r3, [r2], #4
+
+LoopFillZeroCcmbss:
+  ldr  r3, = _eccmbss
+  cmp  r2, r3
+  bcc  FillZeroCcmbss
+
 /* Call the clock system intitialization function.*/
   bl  SystemInit   
 /* Call static constructors */
@@ -38,6 +38,7 @@
  */
 
 #include "lwip/mem.h"
+#include "lwip/ip.h"
 #include "netif/etharp.h"
 #include "ethernetif.h"
 #include "stm32f4x7_eth.h"
@@ -65,6 +66,28 @@ extern ETH_DMADESCTypeDef  *DMARxDescToGet;
 /* Global pointer for last received frame infos */
 extern ETH_DMA_Rx_Frame_infos *DMA_RX_FRAME_infos;
 
+/* Zero-copy receive: a received TCP frame stays in its DMA buffer and is
+   handed to lwIP as a PBUF_REF, the descriptor gets a spare buffer instead.
+   The buffer goes back to the spare list once lwIP drops the pbuf. */
+static uint8_t Rx_Spare_Buff[ETH_RX_SPARE_BUFNB][ETH_RX_BUF_SIZE] __attribute__ ((aligned (4)));
+
+struct rx_loan {
+  struct pbuf *p;     /* pbuf referencing the buffer, NULL if slot unused */
+  uint8_t *buffer;    /* DMA buffer on loan */
+};
+
+static struct rx_loan rx_loans[ETH_RX_SPARE_BUFNB];
+static uint8_t *rx_spare[ETH_RX_SPARE_BUFNB];
+static int rx_spare_count;
+
+/* Zero-copy transmit: Tx descriptors point straight at pbuf payloads when
+   all of them are in SRAM (lwIP pools live in CCM RAM, which the Ethernet
+   DMA can't reach). The frame's pbuf is referenced from its last
+   descriptor until the DMA gives that descriptor back. */
+#define ETH_TX_DMA_RAM_END  (SRAM2_BASE + 0x4000)   /* end of 16K SRAM2 */
+
+static struct pbuf *tx_loans[ETH_TXBUFNB];
+
 
 
 
@@ -77,9 +100,8 @@ extern ETH_DMA_Rx_Frame_infos *DMA_RX_FRAME_infos;
  */
 static void low_level_init(struct netif *netif)
 {
-#ifdef CHECKSUM_BY_HARDWARE
-  int i; 
-#endif
+  int i;
+
   /* set MAC hardware address length */
   netif->hwaddr_len = ETHARP_HWADDR_LEN;
 
@@ -103,8 +125,20 @@ static void low_level_init(struct netif *netif)
 
   /* Initialize Tx Descriptors list: Chain Mode */
   ETH_DMATxDescChainInit(DMATxDscrTab, &Tx_Buff[0][0], ETH_TXBUFNB);
+  for (i=0; i<ETH_TXBUFNB; i++)
+  {
+    tx_loans[i] = NULL;
+  }
   /* Initialize Rx Descriptors list: Chain Mode  */
   ETH_DMARxDescChainInit(DMARxDscrTab, &Rx_Buff[0][0], ETH_RXBUFNB);
+
+  /* All spare Rx buffers are free */
+  for (i=0; i<ETH_RX_SPARE_BUFNB; i++)
+  {
+    rx_spare[i] = Rx_Spare_Buff[i];
+    rx_loans[i].p = NULL;
+  }
+  rx_spare_count = ETH_RX_SPARE_BUFNB;
   
 #ifdef CHECKSUM_BY_HARDWARE
   /* Enable the TCP, UDP and ICMP checksum insertion for the Tx frames */
@@ -121,6 +155,100 @@ static void low_level_init(struct netif *netif)
 
 }
 
+/**
+ * Drops our reference to frames the DMA has finished sending.
+ */
+static void low_level_tx_reclaim(void)
+{
+  int i;
+
+  for (i=0; i<ETH_TXBUFNB; i++)
+  {
+    if ((tx_loans[i] != NULL) && ((DMATxDscrTab[i].Status & ETH_DMATxDesc_OWN) == (u32)RESET))
+    {
+      pbuf_free(tx_loans[i]);
+      tx_loans[i] = NULL;
+    }
+  }
+}
+
+/**
+ * Checks if frame can be sent without copying: every payload is in SRAM
+ * and there are enough free descriptors for one segment per pbuf.
+ */
+static int low_level_tx_zero_copy(struct pbuf *p)
+{
+  ETH_DMADESCTypeDef *desc = DMATxDescToSet;
+  struct pbuf *q;
+  int first = 1;
+
+  for (q = p; q != NULL; q = q->next)
+  {
+    if (q->len == 0)
+      continue;
+
+    if (((u32)q->payload < SRAM1_BASE) || ((u32)q->payload + q->len > ETH_TX_DMA_RAM_END))
+      return 0;
+
+    if (!first)
+    {
+      desc = (ETH_DMADESCTypeDef *)(desc->Buffer2NextDescAddr);
+      if ((desc == DMATxDescToSet) || ((desc->Status & ETH_DMATxDesc_OWN) != (u32)RESET))
+        return 0;
+    }
+    first = 0;
+  }
+
+  return !first;
+}
+
+/**
+ * Points one Tx descriptor at each pbuf of the frame and gives them to
+ * the DMA, the first one last so it never starts on a partial frame.
+ */
+static void low_level_tx_chain(struct pbuf *p)
+{
+  ETH_DMADESCTypeDef *first = DMATxDescToSet;
+  ETH_DMADESCTypeDef *desc = NULL;
+  struct pbuf *q;
+
+  for (q = p; q != NULL; q = q->next)
+  {
+    if (q->len == 0)
+      continue;
+
+    desc = (desc == NULL) ? first : (ETH_DMADESCTypeDef *)(desc->Buffer2NextDescAddr);
+    desc->Buffer1Addr = (uint32_t)q->payload;
+    desc->ControlBufferSize = (q->len & ETH_DMATxDesc_TBS1);
+
+    /* keep chaining and checksum insertion, drop segment bits of earlier frames */
+    desc->Status &= ETH_DMATxDesc_TCH | ETH_DMATxDesc_CIC;
+    if (desc == first)
+      desc->Status |= ETH_DMATxDesc_FS;
+    else
+      desc->Status |= ETH_DMATxDesc_OWN;
+  }
+  desc->Status |= ETH_DMATxDesc_LS;
+
+  /* lwIP may free the frame as soon as we return */
+  pbuf_ref(p);
+  tx_loans[desc - DMATxDscrTab] = p;
+
+  /* Set Own bit of the first descriptor: gives the frame to ETHERNET DMA */
+  __DMB();
+  first->Status |= ETH_DMATxDesc_OWN;
+  DMATxDescToSet = (ETH_DMADESCTypeDef *)(desc->Buffer2NextDescAddr);
+
+  /* When Tx Buffer unavailable flag is set: clear it and resume transmission */
+  if ((ETH->DMASR & ETH_DMASR_TBUS) != (u32)RESET)
+  {
+    /* Clear TBUS ETHERNET DMA flag */
+    ETH->DMASR = ETH_DMASR_TBUS;
+    /* Resume DMA transmission*/
+    ETH->DMATPDR = 0;
+  }
+}
+
 /**
  * This function should do the actual transmission of the packet. The packet is
  * contained in the pbuf that is passed to the function. This pbuf
@@ -141,7 +269,23 @@ static err_t low_level_output(struct netif *netif, struct pbuf *p)
 {
   struct pbuf *q;
   int framelength = 0;
-  u8 *buffer =  (u8 *)(DMATxDescToSet->Buffer1Addr);
+  u8 *buffer;
+
+  low_level_tx_reclaim();
+
+  /* Tx ring full, never write into a buffer the DMA still reads */
+  if ((DMATxDescToSet->Status & ETH_DMATxDesc_OWN) != (u32)RESET)
+    return ERR_USE;
+
+  if (low_level_tx_zero_copy(p))
+  {
+    low_level_tx_chain(p);
+    return ERR_OK;
+  }
+
+  /* descriptor may still point at a pbuf payload from a zero-copy frame */
+  buffer = Tx_Buff[DMATxDescToSet - DMATxDscrTab];
+  DMATxDescToSet->Buffer1Addr = (uint32_t)buffer;
   
   /* copy frame from pbufs to driver buffers */
   for(q = p; q != NULL; q = q->next) 
@@ -159,6 +303,72 @@ static err_t low_level_output(struct netif *netif, struct pbuf *p)
   return ERR_OK;
 }
 
+/**
+ * Gives Rx buffers back to the spare list when lwIP doesn't reference
+ * them anymore (only our own reference is left).
+ */
+static void low_level_rx_reclaim(void)
+{
+  int i;
+
+  for (i=0; i<ETH_RX_SPARE_BUFNB; i++)
+  {
+    if ((rx_loans[i].p != NULL) && (rx_loans[i].p->ref == 1))
+    {
+      pbuf_free(rx_loans[i].p);
+      rx_loans[i].p = NULL;
+      rx_spare[rx_spare_count++] = rx_loans[i].buffer;
+    }
+  }
+}
+
+/**
+ * Checks if frame can be passed to lwIP without copying. Only unfragmented
+ * IPv4 TCP frames qualify, lwIP never grows headers of those back, which
+ * PBUF_REF pbufs don't support.
+ */
+static int low_level_rx_zero_copy(u8 *buffer, u16_t len)
+{
+  struct eth_hdr *ethhdr = (struct eth_hdr *)buffer;
+  struct ip_hdr *iphdr = (struct ip_hdr *)(buffer + SIZEOF_ETH_HDR);
+
+  if ((rx_spare_count == 0) || (len < SIZEOF_ETH_HDR + IP_HLEN))
+    return 0;
+
+  return (ethhdr->type == htons(ETHTYPE_IP)) &&
+         (IPH_PROTO(iphdr) == IP_PROTO_TCP) &&
+         ((IPH_OFFSET(iphdr) & htons(IP_OFFMASK | IP_MF)) == 0);
+}
+
+/**
+ * Wraps DMA buffer of received frame in a PBUF_REF and swaps a spare buffer
+ * into its descriptor.
+ */
+static struct pbuf * low_level_rx_loan(__IO ETH_DMADESCTypeDef *desc, u8 *buffer, u16_t len)
+{
+  struct pbuf *p;
+  int i;
+
+  for (i=0; (i<ETH_RX_SPARE_BUFNB) && (rx_loans[i].p != NULL); i++);
+  if (i == ETH_RX_SPARE_BUFNB)
+    return NULL;
+
+  p = pbuf_alloc(PBUF_RAW, len, PBUF_REF);
+  if (p == NULL)
+    return NULL;
+
+  p->payload = buffer;
+
+  /* keep our own reference to see when lwIP is done with it */
+  pbuf_ref(p);
+  rx_loans[i].p = p;
+  rx_loans[i].buffer = buffer;
+
+  desc->Buffer1Addr = (uint32_t)rx_spare[--rx_spare_count];
+
+  return p;
+}
+
 /**
  * Should allocate a pbuf and transfer the bytes of the incoming
  * packet from the interface into the pbuf.
@@ -187,17 +397,26 @@ static struct pbuf * low_level_input(struct netif *netif)
   len = frame.length;
   buffer = (u8 *)frame.buffer;
   
-  /* We allocate a pbuf chain of pbufs from the Lwip buffer pool */
-  p = pbuf_alloc(PBUF_RAW, len, PBUF_POOL);
-  
-  /* copy received frame to pbuf chain */
-  if (p != NULL)
+  /* Single segment TCP frames are passed without copying */
+  if ((DMA_RX_FRAME_infos->Seg_Count == 1) && low_level_rx_zero_copy(buffer, len))
+  {
+    p = low_level_rx_loan(frame.descriptor, buffer, len);
+  }
+
+  if (p == NULL)
   {
-    for (q = p; q != NULL; q = q->next)
+    /* We allocate a pbuf chain of pbufs from the Lwip buffer pool */
+    p = pbuf_alloc(PBUF_RAW, len, PBUF_POOL);
+  
+    /* copy received frame to pbuf chain */
+    if (p != NULL)
     {
-      memcpy((u8_t*)q->payload, (u8_t*)&buffer[l], q->len);
-      l = l + q->len;
-    }    
+      for (q = p; q != NULL; q = q->next)
+      {
+        memcpy((u8_t*)q->payload, (u8_t*)&buffer[l], q->len);
+        l = l + q->len;
+      }    
+    }
   }
   
   /* Release descriptors to DMA */
@@ -221,6 +440,15 @@ static struct pbuf * low_level_input(struct netif *netif)
   /* Clear Segment_Count */
   DMA_RX_FRAME_infos->Seg_Count =0;
   
+  return p;
+}
+
+/**
+ * Resumes DMA reception if it stopped for lack of descriptors, once all
+ * frames of a batch gave theirs back.
+ */
+static void low_level_rx_resume(void)
+{
   /* When Rx Buffer unavailable flag is set: clear it and resume reception */
   if ((ETH->DMASR & ETH_DMASR_RBUS) != (u32)RESET)  
   {
@@ -229,7 +457,6 @@ static struct pbuf * low_level_input(struct netif *netif)
     /* Resume DMA reception */
     ETH->DMARPDR = 0;
   }
-  return p;
 }
 
 /**
@@ -239,31 +466,68 @@ static struct pbuf * low_level_input(struct netif *netif)
  * interface. Then the type of the received packet is determined and
  * the appropriate input function is called.
  *
+ * Up to ETH_RX_BATCH ready frames are handled per call, the first one
+ * must already have been found by ETH_CheckFrameReceived(). Returns the
+ * result of the last frame.
+ *
  * @param netif the lwip network interface structure for this ethernetif
  */
 err_t ethernetif_input(struct netif *netif)
 {
-  err_t err;
+  err_t err = ERR_OK;
   struct pbuf *p;
+  int n = 0;
 
-  /* move received packet into a new pbuf */
-  p = low_level_input(netif);
+  do
+  {
+    /* lwIP may have dropped loaned buffers of previous frames already */
+    if (rx_spare_count == 0)
+      low_level_rx_reclaim();
 
-  /* no packet could be read, silently ignore this */
-  if (p == NULL) return ERR_MEM;
+    /* move received packet into a new pbuf */
+    p = low_level_input(netif);
+
+    /* no packet could be read, silently ignore this */
+    if (p == NULL)
+    {
+      err = ERR_MEM;
+      continue;
+    }
+
+    /* entry point to the LwIP stack */
+    err = netif->input(p, netif);
+
+    if (err != ERR_OK)
+    {
+      LWIP_DEBUGF(NETIF_DEBUG, ("ethernetif_input: IP input error\n"));
+      pbuf_free(p);
+      p = NULL;
+    }
+  } while ((++n < ETH_RX_BATCH) && ETH_CheckFrameReceived());
+
+  low_level_rx_resume();
+
+  /* most frames are consumed by now, return their buffers */
+  low_level_rx_reclaim();
+
+  /* and release sent frames while no reply is going out */
+  low_level_tx_reclaim();
 
-  /* entry point to the LwIP stack */
-  err = netif->input(p, netif);
-  
-  if (err != ERR_OK)
-  {
-    LWIP_DEBUGF(NETIF_DEBUG, ("ethernetif_input: IP input error\n"));
-    pbuf_free(p);
-    p = NULL;
-  }
   return err;
 }
 
+/**
+ * Tells if the DMA has given back another Rx descriptor. Unlike
+ * ETH_CheckFrameReceived() this doesn't move the driver's frame tracking,
+ * so it can be asked any number of times.
+ *
+ * @return 1 if ethernetif_input() has more to do
+ */
+int ethernetif_input_pending(void)
+{
+  return (DMARxDescToGet->Status & ETH_DMARxDesc_OWN) == (u32)RESET;
+}
+
 /**
  * Should be called at the beginning of the program to set up the
  * network interface. It calls the function low_level_init() to do the
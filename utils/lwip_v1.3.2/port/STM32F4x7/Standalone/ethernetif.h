@@ -7,5 +7,6 @@
 
 err_t ethernetif_init(struct netif *netif);
 err_t ethernetif_input(struct netif *netif);
+int ethernetif_input_pending(void);
 
 #endif
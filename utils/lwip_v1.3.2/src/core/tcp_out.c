@@ -669,6 +669,13 @@ tcp_output_segment(struct tcp_seg *seg, struct tcp_pcb *pcb)
   struct netif *netif;
   u32_t *opts;
 
+  if (seg->p->ref != 1) {
+    /* The netif driver still references this segment's pbuf (zero-copy
+       transmission is in progress), so its headers must not be rewritten
+       under the DMA. Don't send it now, it is retransmitted later. */
+    return;
+  }
+
   /** @bug Exclude retransmitted segments from this count. */
   snmp_inc_tcpoutsegs();
 